@@ -0,0 +1,41 @@
+// Stand-in for the "congrats" server of test.go: sends the same text in the
+// same format, but with a configurable pause between characters so that
+// the upstream scenario does not take a second per character.
+package main
+
+import (
+	"encoding/binary"
+	"flag"
+	"fmt"
+	"net"
+	"os"
+	"time"
+)
+
+const text = "おめでとうございます！"
+
+func main() {
+	port := flag.Int("port", 20408, "port to listen on")
+	delay := flag.Duration("delay", 5*time.Millisecond, "pause between characters")
+	flag.Parse()
+
+	l, err := net.ListenTCP("tcp", &net.TCPAddr{IP: net.IPv4(127, 0, 0, 1), Port: *port})
+	if err != nil {
+		fmt.Fprintf(os.Stderr, "%s\n", err.Error())
+		os.Exit(1)
+	}
+	for {
+		o, err := l.AcceptTCP()
+		if err != nil {
+			fmt.Fprintf(os.Stderr, "%s\n", err.Error())
+			os.Exit(1)
+		}
+		go func(o *net.TCPConn) {
+			defer o.Close()
+			for _, c := range text {
+				binary.Write(o, binary.LittleEndian, c)
+				time.Sleep(*delay)
+			}
+		}(o)
+	}
+}
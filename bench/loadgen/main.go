@@ -0,0 +1,233 @@
+// Closed-loop HTTP load generator for the benchmark suite.  Keeps
+// -concurrency requests in flight for -duration and prints one JSON object
+// with the throughput, the latency percentiles and the peak RSS of every
+// child of the httpd whose pid is in -pidfile.
+package main
+
+import (
+	"encoding/json"
+	"flag"
+	"fmt"
+	"io"
+	"io/ioutil"
+	"net/http"
+	"os"
+	"path/filepath"
+	"sort"
+	"strconv"
+	"strings"
+	"sync"
+	"time"
+)
+
+type latencies struct {
+	P50  float64 `json:"p50"`
+	P99  float64 `json:"p99"`
+	P999 float64 `json:"p999"`
+	Max  float64 `json:"max"`
+	Mean float64 `json:"mean"`
+}
+
+type result struct {
+	Scenario    string           `json:"scenario"`
+	Build       string           `json:"build"`
+	URL         string           `json:"url"`
+	Concurrency int              `json:"concurrency"`
+	Duration    float64          `json:"duration_s"`
+	Requests    int              `json:"requests"`
+	Errors      int              `json:"errors"`
+	Bytes       int64            `json:"bytes"`
+	ReqPerSec   float64          `json:"req_per_s"`
+	LatencyMs   latencies        `json:"latency_ms"`
+	ChildRSSKb  map[string]int64 `json:"child_rss_kb"`
+	MaxRSSKb    int64            `json:"max_child_rss_kb"`
+}
+
+type sample struct {
+	latency time.Duration
+	bytes   int64
+	ok      bool
+}
+
+// Children of parent and their resident set sizes, from /proc
+func childRSS(parent int) map[int]int64 {
+	rss := make(map[int]int64)
+	stats, _ := filepath.Glob("/proc/[0-9]*/stat")
+	for _, stat := range stats {
+		data, err := ioutil.ReadFile(stat)
+		if err != nil {
+			continue
+		}
+		// pid (comm) state ppid ...; comm may contain spaces
+		s := string(data)
+		fields := strings.Fields(s[strings.LastIndexByte(s, ')')+1:])
+		if len(fields) < 2 {
+			continue
+		}
+		if ppid, _ := strconv.Atoi(fields[1]); ppid != parent {
+			continue
+		}
+		dir := filepath.Dir(stat)
+		pid, _ := strconv.Atoi(filepath.Base(dir))
+		status, err := ioutil.ReadFile(filepath.Join(dir, "status"))
+		if err != nil {
+			continue
+		}
+		for _, line := range strings.Split(string(status), "\n") {
+			if strings.HasPrefix(line, "VmRSS:") {
+				kb, _ := strconv.ParseInt(strings.Fields(line)[1], 10, 64)
+				rss[pid] = kb
+			}
+		}
+	}
+	return rss
+}
+
+func readPid(path string) int {
+	data, err := ioutil.ReadFile(path)
+	if err != nil {
+		return 0
+	}
+	pid, _ := strconv.Atoi(strings.TrimSpace(string(data)))
+	return pid
+}
+
+func percentile(sorted []time.Duration, p float64) float64 {
+	if len(sorted) == 0 {
+		return 0
+	}
+	i := int(float64(len(sorted))*p+0.5) - 1
+	if i < 0 {
+		i = 0
+	} else if i >= len(sorted) {
+		i = len(sorted) - 1
+	}
+	return float64(sorted[i]) / float64(time.Millisecond)
+}
+
+func fetch(client *http.Client, url string) sample {
+	start := time.Now()
+	resp, err := client.Get(url)
+	if err != nil {
+		return sample{latency: time.Since(start)}
+	}
+	n, err := io.Copy(ioutil.Discard, resp.Body)
+	resp.Body.Close()
+	return sample{latency: time.Since(start), bytes: n, ok: err == nil && resp.StatusCode == http.StatusOK}
+}
+
+func main() {
+	name := flag.String("name", "", "scenario name to report")
+	build := flag.String("build", "", "build the results are for, e.g. a commit id")
+	url := flag.String("url", "http://localhost:8080/", "URL to request")
+	concurrency := flag.Int("concurrency", 16, "requests in flight")
+	duration := flag.Duration("duration", 10*time.Second, "how long to measure")
+	warmup := flag.Duration("warmup", 2*time.Second, "how long to run before measuring")
+	wait := flag.Duration("wait", 0, "how long to wait for the server to come up")
+	pidfile := flag.String("pidfile", "", "pid file of the httpd parent, for child RSS")
+	timeout := flag.Duration("timeout", 60*time.Second, "timeout of a single request")
+	flag.Parse()
+
+	client := &http.Client{
+		Timeout:   *timeout,
+		Transport: &http.Transport{MaxIdleConnsPerHost: *concurrency},
+	}
+
+	for deadline := time.Now().Add(*wait); ; {
+		if fetch(client, *url).ok {
+			break
+		}
+		if time.Now().After(deadline) {
+			fmt.Fprintf(os.Stderr, "%s did not come up\n", *url)
+			os.Exit(1)
+		}
+		time.Sleep(200 * time.Millisecond)
+	}
+
+	var (
+		mu      sync.Mutex
+		samples []sample
+		wg      sync.WaitGroup
+	)
+	start := time.Now()
+	measureFrom := start.Add(*warmup)
+	end := measureFrom.Add(*duration)
+	for i := 0; i < *concurrency; i++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			for time.Now().Before(end) {
+				began := time.Now()
+				s := fetch(client, *url)
+				if began.After(measureFrom) {
+					mu.Lock()
+					samples = append(samples, s)
+					mu.Unlock()
+				}
+			}
+		}()
+	}
+
+	peak := make(map[int]int64)
+	done := make(chan struct{})
+	go func() {
+		wg.Wait()
+		close(done)
+	}()
+	parent := readPid(*pidfile)
+	ticker := time.NewTicker(100 * time.Millisecond)
+	for sampling := true; sampling; {
+		if parent != 0 {
+			for pid, kb := range childRSS(parent) {
+				if kb > peak[pid] {
+					peak[pid] = kb
+				}
+			}
+		}
+		select {
+		case <-done:
+			sampling = false
+		case <-ticker.C:
+		}
+	}
+	ticker.Stop()
+
+	r := result{
+		Scenario:    *name,
+		Build:       *build,
+		URL:         *url,
+		Concurrency: *concurrency,
+		Duration:    duration.Seconds(),
+		ChildRSSKb:  make(map[string]int64),
+	}
+	var total time.Duration
+	var lat []time.Duration
+	for _, s := range samples {
+		r.Requests++
+		if !s.ok {
+			r.Errors++
+		}
+		r.Bytes += s.bytes
+		total += s.latency
+		lat = append(lat, s.latency)
+	}
+	sort.Slice(lat, func(i, j int) bool { return lat[i] < lat[j] })
+	r.ReqPerSec = float64(r.Requests) / duration.Seconds()
+	r.LatencyMs = latencies{
+		P50:  percentile(lat, 0.50),
+		P99:  percentile(lat, 0.99),
+		P999: percentile(lat, 0.999),
+		Max:  percentile(lat, 1),
+	}
+	if len(lat) > 0 {
+		r.LatencyMs.Mean = float64(total) / float64(len(lat)) / float64(time.Millisecond)
+	}
+	for pid, kb := range peak {
+		r.ChildRSSKb[strconv.Itoa(pid)] = kb
+		if kb > r.MaxRSSKb {
+			r.MaxRSSKb = kb
+		}
+	}
+	out, _ := json.Marshal(r)
+	fmt.Println(string(out))
+}
@@ -0,0 +1,72 @@
+#!/bin/sh
+# Runs each benchmark scenario against an httpd of its own, started with
+# httpd.minimal.conf, and appends one JSON object per scenario to the
+# results file given as the first argument.
+
+set -e
+
+: ${HTTPD:=httpd}
+: ${HTTPD_ARGS:=}
+: ${BENCH_CONCURRENCY:=16}
+: ${BENCH_DURATION:=10s}
+: ${BENCH_WARMUP:=2s}
+: ${BENCH_POOL_SIZE:=4}
+: ${BENCH_UPSTREAM_DELAY:=5ms}
+: ${BENCH_RESIDENT_VMS:=1}
+: ${BENCH_BUILD:=$(git describe --always --dirty 2>/dev/null || echo unknown)}
+
+results=${1:-bench/results.json}
+pidfile=$PWD/bench/httpd.pid
+export PWD
+export CONGRATS_SERVER_HOST=127.0.0.1
+
+stop_httpd() {
+    if [ -f "$pidfile" ]; then
+        pid=$(cat "$pidfile")
+        kill "$pid" 2>/dev/null || true
+        while kill -0 "$pid" 2>/dev/null; do
+            sleep 0.1
+        done
+        rm -f "$pidfile"
+    fi
+}
+
+# scenario name, URL path, OzVMPoolSize and optionally another directive
+run() {
+    $HTTPD $HTTPD_ARGS -f "$PWD/httpd.minimal.conf" \
+        -c "PidFile $pidfile" \
+        -c "OzVMPoolSize $3" \
+        ${4:+-c "$4"} \
+        -k start
+    while [ ! -f "$pidfile" ]; do
+        sleep 0.1
+    done
+    bench/bin/loadgen -name "$1" -build "$BENCH_BUILD" \
+        -url "http://localhost:8080$2" -pidfile "$pidfile" \
+        -concurrency "$BENCH_CONCURRENCY" -duration "$BENCH_DURATION" \
+        -warmup "$BENCH_WARMUP" -wait 30s >> "$results"
+    stop_httpd
+}
+
+bench/bin/backend -delay "$BENCH_UPSTREAM_DELAY" &
+backend=$!
+trap 'stop_httpd; kill $backend' EXIT
+
+run cold /bench/scenarios/hello 0
+run hello /bench/scenarios/hello "$BENCH_POOL_SIZE"
+run hello-numa /bench/scenarios/hello "$BENCH_POOL_SIZE" "OzNUMA On"
+run stream /bench/scenarios/stream "$BENCH_POOL_SIZE"
+run flushes /bench/scenarios/flushes "$BENCH_POOL_SIZE"
+run escape /bench/scenarios/escape "$BENCH_POOL_SIZE"
+run escape-oz /bench/scenarios/escape-oz "$BENCH_POOL_SIZE"
+run sendfile /bench/scenarios/sendfile "$BENCH_POOL_SIZE"
+run static /bench/scenarios/stream.txt "$BENCH_POOL_SIZE"
+run upstream /hello "$BENCH_POOL_SIZE"
+run resident /bench/scenarios/resident 0 "OzResidentVMs $BENCH_RESIDENT_VMS"
+
+# The same as upstream under mpm_event, with and without suspending
+worker_args=$HTTPD_ARGS
+HTTPD_ARGS="$worker_args -D EventMPM"
+run upstream-event /hello "$BENCH_POOL_SIZE"
+run upstream-suspend /hello "$BENCH_POOL_SIZE" "OzSuspend On"
+HTTPD_ARGS=$worker_args
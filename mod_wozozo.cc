@@ -29,18 +29,44 @@
 #include "http_request.h"
 #include "util_script.h"
 #include "http_connection.h"
+#include "ap_mpm.h"
 
 #include "apr_strings.h"
+#include "apr_lib.h"
 
 #include <mozart.hh>
 #include <boostenv.hh>
 
-#include <boost/optional.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/scope_exit.hpp>
+#include <boost/lockfree/spsc_queue.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <iterator>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
 
 #include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#if defined(__AVX2__)
+#  include <immintrin.h>
+#  define WOZOZO_SIMD
+#elif defined(__SSE2__)
+#  include <emmintrin.h>
+#  define WOZOZO_SIMD
+#endif
 
 #ifdef MOZART_WINDOWS
 #  include <windows.h>
@@ -61,8 +87,28 @@ typedef struct mozart_vm_args_t {
     char const*  base_functor_path;
     char const*  oz_search_path;
     char const*  oz_search_load;
+    char const*  boot_image_path;
     size_t min_memory;
     size_t max_memory;
+    size_t pool_size;
+    size_t io_threads;
+    size_t max_requests_per_vm;
+    bool functor_cache;
+    size_t output_high_water_mark;
+    size_t read_chunk_size;
+    size_t max_vms;
+    size_t queue_depth;
+    apr_interval_time_t queue_timeout;
+    apr_interval_time_t retry_after;
+    size_t response_cache_size;
+    size_t response_cache_max_entry_size;
+    size_t kv_store_size;
+    size_t file_cache_size;
+    char const* vm_cpus;
+    char const* io_cpus;
+    bool numa;
+    bool profile;
+    size_t profile_rate;
 
     mozart_vm_args_t();
 } mozart_vm_args_t;
@@ -73,458 +119,6060 @@ inline mozart_vm_args_t::mozart_vm_args_t()
       base_functor_path(0),
       oz_search_path(0),
       oz_search_load(0),
+      boot_image_path(0),
       min_memory(32 * mozart::MegaBytes),
 #if defined(_WIN32) && !defined(_WIN64)
-      max_memory(512 * mozart::MegaBytes)
+      max_memory(512 * mozart::MegaBytes),
 #else
-      max_memory(768 * mozart::MegaBytes)
+      max_memory(768 * mozart::MegaBytes),
 #endif
+      pool_size(0),
+      io_threads(1),
+      max_requests_per_vm(0),
+      functor_cache(false),
+      output_high_water_mark(256 * 1024),
+      read_chunk_size(64 * 1024),
+      max_vms(0),
+      queue_depth(0),
+      queue_timeout(0),
+      retry_after(apr_time_from_sec(1)),
+      response_cache_size(0),
+      response_cache_max_entry_size(1024 * 1024),
+      kv_store_size(0),
+      file_cache_size(64),
+      vm_cpus(0),
+      io_cpus(0),
+      numa(false),
+      profile(false),
+      profile_rate(99)
 {
 }
 
-typedef struct wozozo_server_conf_t {
-    mozart_vm_args_t vm_args;
-    std::shared_ptr<mozart::boostenv::BoostEnvironment> env;
-    std::unique_ptr<boost::thread> io_thread;
-    std::unique_ptr<boost::asio::io_service::work> work;
+// Per-directory overrides of the heap settings, the number of resident VMs
+// serving the directory, its flush policy, timeout and whether its
+// requests may be suspended.  Zero and -1 mean unset.
+typedef struct wozozo_dir_conf_t {
+    size_t min_memory;
+    size_t max_memory;
+    int heap_auto_tune;
+    int resident_vms;
+    apr_off_t flush_min_bytes;
+    apr_interval_time_t flush_max_delay;
+    int flush_every;
+    apr_interval_time_t request_timeout;
+    int suspend;
+} wozozo_dir_conf_t;
 
-    wozozo_server_conf_t() {}
-} wozozo_server_conf_t;
+static const apr_interval_time_t default_flush_max_delay = 100000;
 
+// How often a worker waiting on a quiet VM checks whether its client is
+// still there
+static const apr_interval_time_t abort_check_interval = 1000000;
 
-static mozart::boostenv::BoostEnvironment* init_mozart_vm_env(server_rec *s, mozart_vm_args_t const& args);
-static int check_mozart_vm_args(server_rec *s, mozart_vm_args_t const& args);
+struct condvar {
+    boost::condition_variable cond;
+    boost::mutex mtx;
+    bool signaled;
 
-extern "C" {
-extern module AP_MODULE_DECLARE_DATA wozozo_module;
+    inline condvar(): signaled(false) {}
 
-static const char* register_oz_root(cmd_parms* cmd, void* dummy, const char* path)
-{
-    server_rec* s = cmd->server;
-    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(s->module_config, &wozozo_module));
-    conf->vm_args.oz_home = path;
-    return NULL;
-}
+    inline void wait() {
+        boost::unique_lock<boost::mutex> lock(mtx);
+        while (!signaled) {
+            cond.wait(lock);
+        }
+    }
 
-static const char* register_oz_search_path(cmd_parms* cmd, void* dummy, const char* path)
-{
-    server_rec* s = cmd->server;
-    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(s->module_config, &wozozo_module));
-    conf->vm_args.oz_search_path = path;
-    return NULL;
-}
+    inline void notify() {
+        {
+            boost::lock_guard<boost::mutex> lock(mtx);
+            signaled = true;
+        }
+        cond.notify_one();
+    }
+};
 
-static const char* register_oz_search_load(cmd_parms* cmd, void* dummy, const char* path)
-{
-    server_rec* s = cmd->server;
-    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(s->module_config, &wozozo_module));
-    conf->vm_args.oz_search_load = path;
-    return NULL;
-}
+// A compiled functor mapped read-only from disk.  The mapping is shared, so
+// the page cache holds a single copy for all the children using it.  What
+// it is revalidated against comes from the descriptor it was mapped from,
+// so that a file replaced in between is not taken for the mapped one.  A
+// functor has to be replaced by renaming a new file over it, as truncating
+// a mapped file makes reading past its new end raise SIGBUS.
+struct functor_image {
+    apr_pool_t* pool;
+    char const* base;
+    apr_ino_t inode;
+    apr_time_t mtime;
+    apr_off_t size;
 
-static const char* register_init_functor_path(cmd_parms* cmd, void* dummy, const char* path)
-{
-    server_rec* s = cmd->server;
-    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(s->module_config, &wozozo_module));
-    conf->vm_args.init_functor_path = path;
-    return NULL;
-}
+    inline functor_image(): pool(0), base(0), inode(0), mtime(0), size(0) {}
 
-static const char* register_base_functor_path(cmd_parms* cmd, void* dummy, const char* path)
-{
-    server_rec* s = cmd->server;
-    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(s->module_config, &wozozo_module));
-    conf->vm_args.base_functor_path = path;
-    return NULL;
-}
+    inline ~functor_image() {
+        if (pool) {
+            apr_pool_destroy(pool);
+        }
+    }
+
+    inline apr_status_t map(char const* path) {
+        apr_file_t* file;
+        apr_finfo_t finfo;
+        apr_mmap_t* mm;
+        apr_status_t rv = apr_pool_create(&pool, NULL);
+        if (rv != APR_SUCCESS
+            || (rv = apr_file_open(&file, path, APR_FOPEN_READ | APR_FOPEN_BINARY, APR_OS_DEFAULT, pool)) != APR_SUCCESS
+            || (rv = apr_file_info_get(&finfo, APR_FINFO_MIN | APR_FINFO_INODE, file)) != APR_SUCCESS) {
+            return rv;
+        }
+        if (finfo.filetype != APR_REG || finfo.size <= 0) {
+            return APR_EINVAL;
+        }
+        // The mapping outlives the descriptor and goes with the pool
+        rv = apr_mmap_create(&mm, file, 0, static_cast<apr_size_t>(finfo.size), APR_MMAP_READ, pool);
+        apr_file_close(file);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+        base = static_cast<char const*>(mm->mm);
+        inode = finfo.inode;
+        mtime = finfo.mtime;
+        size = finfo.size;
+        return APR_SUCCESS;
+    }
 
+    inline bool matches(apr_finfo_t const& finfo) const {
+        return inode == finfo.inode && mtime == finfo.mtime && size == finfo.size;
+    }
 
-static const char* register_max_memory(cmd_parms* cmd, void* dummy, const char* value)
-{
-    server_rec* s = cmd->server;
-    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(s->module_config, &wozozo_module));
-    apr_off_t _value;
-    if (apr_strtoff(&_value, value, NULL, 10)) {
-        return "Invalid value for OzMaxMemory.";
+    inline char const* data() const { return base; }
+};
+
+// Per-child cache of application functors keyed by path.  An entry is
+// revalidated against the request's finfo, which the core has usually
+// filled in already, and which is stat()ed otherwise.
+struct functor_cache {
+    boost::mutex mtx;
+    std::unordered_map<std::string, std::shared_ptr<functor_image>> entries;
+
+    std::shared_ptr<functor_image> get(request_rec* r) {
+        apr_finfo_t finfo = r->finfo;
+        if (finfo.filetype != APR_REG) {
+            if (APR_SUCCESS != apr_stat(&finfo, r->filename, APR_FINFO_MIN | APR_FINFO_INODE, r->pool) || finfo.filetype != APR_REG) {
+                return std::shared_ptr<functor_image>();
+            }
+        }
+        std::string path(r->filename);
+        {
+            boost::lock_guard<boost::mutex> lock(mtx);
+            auto i = entries.find(path);
+            if (i != entries.end() && i->second->matches(finfo)) {
+                return i->second;
+            }
+        }
+        std::shared_ptr<functor_image> image(std::make_shared<functor_image>());
+        apr_status_t rv = image->map(r->filename);
+        if (rv != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, "could not map %s", r->filename);
+            return std::shared_ptr<functor_image>();
+        }
+        boost::lock_guard<boost::mutex> lock(mtx);
+        entries[path] = image;
+        return image;
     }
-    conf->vm_args.max_memory = static_cast<size_t>(_value);
-    return NULL;
-}
+};
 
+// A template parsed once into instructions.  The syntax is a subset of
+// Mustache: {{name}} writes a field of the record it is rendered from,
+// HTML-escaped, and {{{name}}} or {{&name}} writes it as it is.
+// {{#name}}...{{/name}} is repeated for each element of a list, written
+// once if the field is true or any other value, with that value as the
+// innermost record, and skipped if it is missing, false, unit or nil.
+// {{^name}}...{{/name}} is written only when {{#name}} would be skipped.
+// {{.}} is the innermost value itself, and {{! ...}} a comment.
+struct compiled_template {
+    struct instr {
+        enum kind_t { TEXT, FIELD, RAW, SECTION, INVERTED, END } kind;
+        size_t offset; // into source, of the text or the field name
+        size_t len;
+        size_t end; // for SECTION and INVERTED, the index of the END
+    };
 
-static const char* register_min_memory(cmd_parms* cmd, void* dummy, const char* value)
+    std::string source;
+    std::vector<instr> code;
+    std::string error; // why it could not be parsed, if it could not
+    std::time_t mtime;
+    uintmax_t size;
+
+    inline compiled_template(std::string&& source, std::time_t mtime, uintmax_t size)
+        : source(std::move(source)), mtime(mtime), size(size) {
+        parse();
+    }
+
+    inline char const* at(instr const& i) const {
+        return source.data() + i.offset;
+    }
+
+private:
+    inline void parse() {
+        std::vector<size_t> open;
+        size_t p = 0;
+        while (p < source.size()) {
+            size_t tag = source.find("{{", p);
+            if (tag == std::string::npos) {
+                tag = source.size();
+            }
+            if (tag > p) {
+                emit(instr::TEXT, p, tag - p);
+            }
+            if (tag == source.size()) {
+                break;
+            }
+            bool triple = source.compare(tag, 3, "{{{") == 0;
+            size_t start = tag + (triple ? 3 : 2);
+            size_t close = source.find(triple ? "}}}" : "}}", start);
+            if (close == std::string::npos) {
+                fail("unterminated tag", tag);
+                return;
+            }
+            p = close + (triple ? 3 : 2);
+            char sigil = triple ? '&' : source[start];
+            if (!triple && strchr("&#^/!", sigil)) {
+                ++start;
+            } else if (!triple) {
+                sigil = 0;
+            }
+            // The name, without surrounding spaces
+            size_t end = close;
+            while (start < end && apr_isspace(source[start])) {
+                ++start;
+            }
+            while (end > start && apr_isspace(source[end - 1])) {
+                --end;
+            }
+            if (sigil == '!') {
+                continue;
+            }
+            if (start == end) {
+                fail("empty tag", tag);
+                return;
+            }
+            switch (sigil) {
+            case 0:
+                emit(instr::FIELD, start, end - start);
+                break;
+            case '&':
+                emit(instr::RAW, start, end - start);
+                break;
+            case '#':
+            case '^':
+                open.push_back(code.size());
+                emit(sigil == '#' ? instr::SECTION : instr::INVERTED, start, end - start);
+                break;
+            case '/':
+                if (open.empty() || source.compare(code[open.back()].offset, code[open.back()].len, source, start, end - start)) {
+                    fail("unmatched {{/", tag);
+                    return;
+                }
+                code[open.back()].end = code.size();
+                open.pop_back();
+                emit(instr::END, start, end - start);
+                break;
+            }
+        }
+        if (!open.empty()) {
+            fail("unclosed section", code[open.back()].offset);
+        }
+    }
+
+    inline void emit(instr::kind_t kind, size_t offset, size_t len) {
+        instr i = { kind, offset, len, 0 };
+        code.push_back(i);
+    }
+
+    inline void fail(char const* what, size_t offset) {
+        size_t line = std::count(source.begin(), source.begin() + offset, '\n') + 1;
+        error = std::string(what) + " at line " + std::to_string(line);
+        code.clear();
+    }
+};
+
+// Per-child cache of compiled templates keyed by path.  An entry is used
+// until the file's mtime or size changes.
+struct template_cache {
+    boost::mutex mtx;
+    std::unordered_map<std::string, std::shared_ptr<compiled_template const>> entries;
+
+    // Null if the file cannot be read
+    std::shared_ptr<compiled_template const> get(fs::path const& path) {
+        boost::system::error_code ec;
+        std::time_t mtime = fs::last_write_time(path, ec);
+        uintmax_t size = ec ? 0 : fs::file_size(path, ec);
+        if (ec) {
+            return std::shared_ptr<compiled_template const>();
+        }
+        {
+            boost::lock_guard<boost::mutex> lock(mtx);
+            auto i = entries.find(path.string());
+            if (i != entries.end() && i->second->mtime == mtime && i->second->size == size) {
+                return i->second;
+            }
+        }
+        fs::ifstream in(path, std::ios::binary);
+        if (!in) {
+            return std::shared_ptr<compiled_template const>();
+        }
+        std::string source((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        std::shared_ptr<compiled_template const> entry(std::make_shared<compiled_template>(std::move(source), mtime, size));
+        boost::lock_guard<boost::mutex> lock(mtx);
+        entries[path.string()] = entry;
+        return entry;
+    }
+};
+
+// Parses a CPU list in the format of /sys/devices/system/node/node*/cpulist,
+// such as "0-3,8-11", appending the CPUs to cpus
+static bool parse_cpu_list(char const* p, std::vector<int>& cpus)
 {
-    server_rec* s = cmd->server;
-    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(s->module_config, &wozozo_module));
-    apr_off_t _value;
-    if (apr_strtoff(&_value, value, NULL, 10)) {
-        return "Invalid value for OzMinMemory.";
+    while (*p && *p != '\n') {
+        char* end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p || first < 0) {
+            return false;
+        }
+        p = end;
+        if (*p == '-') {
+            ++p;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first) {
+                return false;
+            }
+            p = end;
+        }
+#ifdef __linux__
+        if (last >= CPU_SETSIZE) {
+            return false;
+        }
+#endif
+        for (long cpu = first; cpu <= last; ++cpu) {
+            cpus.push_back(static_cast<int>(cpu));
+        }
+        if (*p == ',') {
+            ++p;
+        } else if (*p && *p != '\n') {
+            return false;
+        }
     }
-    conf->vm_args.min_memory = static_cast<size_t>(_value);
-    return NULL;
+    return !cpus.empty();
 }
 
+// Where the VM and I/O threads of a child run (OzVMCPUs, OzIOCPUs,
+// OzNUMA).  With OzNUMA each thread is kept on the CPUs of a single node,
+// nodes being taken in turn, so that the heap a VM first touches is
+// allocated on the node it runs on.
+struct cpu_placement {
+    struct node {
+        int id;
+        std::vector<int> cpus;
+        std::atomic<uint64_t> vms;      // VM threads placed on the node
+        std::atomic<uint64_t> requests; // served by them
 
-static command_rec wozozo_commands[] = {
+        inline node(int id): id(id), vms(0), requests(0) {}
+    };
 
-    AP_INIT_TAKE1("OzHome", reinterpret_cast<char const*(*)()>(register_oz_root), NULL, RSRC_CONF,
-                  "Specify Mozart installation directory."),
+    std::vector<int> vm_cpus; // empty for any
+    std::vector<int> io_cpus; // likewise
+    bool numa;
+    std::deque<node> nodes;
+    std::atomic<size_t> next_vm;
 
-    AP_INIT_TAKE1("OzSearchPath", reinterpret_cast<char const*(*)()>(register_oz_search_path), NULL, RSRC_CONF,
-                  "Specify the directory for Mozart's search path."),
+    inline cpu_placement(bool numa): numa(numa), next_vm(0) {}
 
-    AP_INIT_TAKE1("OzSearchLoad", reinterpret_cast<char const*(*)()>(register_oz_search_load), NULL, RSRC_CONF,
-                  "Specify the directory for Mozart's search load path."),
+    // Reads the nodes from sysfs.  Without it, all CPUs make up node 0.
+    void load_nodes() {
+        boost::system::error_code ec;
+        std::map<int, std::vector<int>> found;
+        for (fs::directory_iterator i("/sys/devices/system/node", ec), end; !ec && i != end; i.increment(ec)) {
+            std::string name(i->path().filename().string());
+            if (name.compare(0, 4, "node") || name.size() == 4 || name.find_first_not_of("0123456789", 4) != std::string::npos) {
+                continue;
+            }
+            fs::ifstream in(i->path() / "cpulist");
+            std::string list;
+            std::vector<int> cpus;
+            if (std::getline(in, list) && parse_cpu_list(list.c_str(), cpus)) {
+                found[atoi(name.c_str() + 4)] = cpus;
+            }
+        }
+        for (auto const& i: found) {
+            nodes.emplace_back(i.first);
+            nodes.back().cpus = i.second;
+        }
+        if (nodes.empty()) {
+            nodes.emplace_back(0);
+        }
+    }
 
-    AP_INIT_TAKE1("OzInitFunctorPath", reinterpret_cast<char const*(*)()>(register_init_functor_path), NULL, RSRC_CONF,
-                  "Specify the path to Init.ozf functor."),
+    // Pins the calling VM thread.  Returns the node it is placed on, if
+    // OzNUMA is on.
+    inline node* place_vm() {
+        return place(vm_cpus, next_vm++);
+    }
 
-    AP_INIT_TAKE1("OzBaseFunctorPath", reinterpret_cast<char const*(*)()>(register_base_functor_path), NULL, RSRC_CONF,
-                  "Specify the path to Base.ozf functor."),
+    inline node* place_io(size_t i) {
+        return place(io_cpus, i);
+    }
 
-    AP_INIT_TAKE1("OzMaxMemory", reinterpret_cast<char const*(*)()>(register_max_memory), NULL, RSRC_CONF,
-                  "Specify the maximum heap size."),
+    // The numa_hit, numa_miss, local_node and other_node counters the
+    // kernel keeps for the node, in that order; zero if it does not
+    static void read_numastat(int id, uint64_t (&counters)[4]) {
+        static char const* const names[] = { "numa_hit", "numa_miss", "local_node", "other_node" };
+        std::fill_n(counters, 4, 0);
+        fs::ifstream in(fs::path("/sys/devices/system/node") / ("node" + std::to_string(id)) / "numastat");
+        std::string name;
+        uint64_t value;
+        while (in >> name >> value) {
+            for (size_t i = 0; i < 4; ++i) {
+                if (name == names[i]) {
+                    counters[i] = value;
+                }
+            }
+        }
+    }
 
-    AP_INIT_TAKE1("OzMinMemory", reinterpret_cast<char const*(*)()>(register_min_memory), NULL, RSRC_CONF,
-                  "Specify the minimum heap size."),
-    {NULL}
+private:
+    node* place(std::vector<int> const& allowed, size_t turn) {
+        std::vector<int> cpus(allowed);
+        node* chosen = 0;
+        if (numa) {
+            // The nodes that have any of the allowed CPUs, in turn
+            std::vector<std::pair<node*, std::vector<int>>> candidates;
+            for (auto& n: nodes) {
+                std::vector<int> common;
+                for (int cpu: n.cpus) {
+                    if (allowed.empty() || std::find(allowed.begin(), allowed.end(), cpu) != allowed.end()) {
+                        common.push_back(cpu);
+                    }
+                }
+                if (!common.empty() || n.cpus.empty()) {
+                    candidates.push_back(std::make_pair(&n, common));
+                }
+            }
+            if (!candidates.empty()) {
+                auto const& c = candidates[turn % candidates.size()];
+                chosen = c.first;
+                if (!c.second.empty()) {
+                    cpus = c.second;
+                }
+            }
+        }
+        if (!cpus.empty()) {
+            pin(cpus);
+        }
+        return chosen;
+    }
+
+    static void pin(std::vector<int> const& cpus) {
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu: cpus) {
+            CPU_SET(cpu, &set);
+        }
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+    }
 };
 
+// The node the VM running on this thread was placed on, under OzNUMA
+static thread_local cpu_placement::node* current_node = 0;
 
-static void *wozozo_create_server_config(apr_pool_t *p, server_rec *s)
+// A file Apache.sendFile opened.  Every response sending the file shares
+// the descriptor, so it is opened APR_FOPEN_XTHREAD: a file bucket that
+// has to be read, rather than handed to sendfile(2), then reopens the file
+// for itself instead of moving the shared offset.
+struct open_file {
+    apr_pool_t* pool;
+    apr_file_t* fd;
+    apr_finfo_t finfo;
+
+    inline open_file(): pool(0), fd(0) {}
+
+    inline ~open_file() {
+        if (pool) {
+            apr_pool_destroy(pool);
+        }
+    }
+};
+
+// Per-child cache of the files Apache.sendFile opened.  Least recently
+// used ones are dropped beyond capacity, and closed once the last
+// response sending them is done.
+struct file_cache {
+    typedef std::list<std::pair<std::string, std::shared_ptr<open_file>>> lru_list;
+
+    size_t capacity;
+    boost::mutex mtx;
+    lru_list lru;
+    std::unordered_map<std::string, lru_list::iterator> entries;
+    std::atomic<uint64_t> opens;
+
+    inline file_cache(size_t capacity): capacity(capacity), opens(0) {}
+
+    // Null if path is not a regular file that can be read
+    std::shared_ptr<open_file> get(std::string const& path) {
+        boost::system::error_code ec;
+        std::time_t mtime = fs::last_write_time(path, ec);
+        uintmax_t size = ec ? 0 : fs::file_size(path, ec);
+        if (ec) {
+            return std::shared_ptr<open_file>();
+        }
+        {
+            boost::lock_guard<boost::mutex> lock(mtx);
+            auto i = entries.find(path);
+            if (i != entries.end()) {
+                open_file const& file = *i->second->second;
+                if (apr_time_sec(file.finfo.mtime) == mtime && static_cast<uintmax_t>(file.finfo.size) == size) {
+                    lru.splice(lru.begin(), lru, i->second);
+                    return i->second->second;
+                }
+            }
+        }
+        std::shared_ptr<open_file> file(std::make_shared<open_file>());
+        if (apr_pool_create(&file->pool, NULL) != APR_SUCCESS
+            || apr_file_open(&file->fd, path.c_str(), APR_FOPEN_READ | APR_FOPEN_BINARY | APR_FOPEN_XTHREAD | APR_FOPEN_SENDFILE_ENABLED,
+                             APR_OS_DEFAULT, file->pool) != APR_SUCCESS
+            || apr_file_info_get(&file->finfo, APR_FINFO_SIZE | APR_FINFO_MTIME | APR_FINFO_TYPE, file->fd) != APR_SUCCESS
+            || file->finfo.filetype != APR_REG) {
+            return std::shared_ptr<open_file>();
+        }
+        ++opens;
+        if (capacity > 0) {
+            boost::lock_guard<boost::mutex> lock(mtx);
+            auto i = entries.find(path);
+            if (i != entries.end()) {
+                lru.erase(i->second);
+            }
+            lru.push_front(std::make_pair(path, file));
+            entries[path] = lru.begin();
+            while (entries.size() > capacity) {
+                entries.erase(lru.back().first);
+                lru.pop_back();
+            }
+        }
+        return file;
+    }
+
+    inline size_t size() {
+        boost::lock_guard<boost::mutex> lock(mtx);
+        return entries.size();
+    }
+};
+
+// A response an Oz handler allowed to be reused with Apache.cacheFor
+struct cached_response {
+    std::string url;
+    std::string key;
+    apr_time_t stored;
+    apr_time_t expires;
+    apr_time_t mtime;
+    std::string content_type;
+    std::vector<std::pair<std::string, std::string>> headers;
+    std::string body;
+
+    inline size_t size() const {
+        size_t n = url.size() + key.size() + content_type.size() + body.size();
+        for (auto const& header: headers) {
+            n += header.first.size() + header.second.size();
+        }
+        return n;
+    }
+};
+
+static int collect_cached_header(void* data, char const* key, char const* value)
 {
-    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(apr_pcalloc(p, sizeof(wozozo_server_conf_t)));
-    new (conf) wozozo_server_conf_t(); 
-    return conf;
+    if (strcasecmp(key, "Content-Length") && strcasecmp(key, "Content-Type") && strcasecmp(key, "Date")) {
+        static_cast<cached_response*>(data)->headers.push_back(std::make_pair(key, value));
+    }
+    return 1;
 }
 
+// Per-child cache of responses, keyed by URL and by the values of the
+// request headers named in the response's Vary header.  Least recently
+// used entries are evicted once capacity bytes are held.
+struct response_cache {
+    typedef std::list<std::shared_ptr<cached_response const>> lru_list;
+
+    size_t capacity;
+    size_t used;
+    boost::mutex mtx;
+    lru_list lru;
+    std::unordered_map<std::string, lru_list::iterator> entries;
+    // Headers the response of each URL varies on, kept as long as an entry
+    // for the URL is
+    struct vary_entry {
+        std::vector<std::string> headers;
+        size_t entries;
+    };
+    std::unordered_map<std::string, vary_entry> varies;
+
+    inline response_cache(size_t capacity): capacity(capacity), used(0) {}
+
+    std::shared_ptr<cached_response const> lookup(request_rec* r) {
+        std::string url(ap_construct_url(r->pool, r->unparsed_uri, r));
+        apr_time_t now = apr_time_now();
+        boost::lock_guard<boost::mutex> lock(mtx);
+        auto v = varies.find(url);
+        if (v == varies.end()) {
+            return std::shared_ptr<cached_response const>();
+        }
+        auto i = entries.find(key_of(r, url, v->second.headers));
+        if (i == entries.end()) {
+            return std::shared_ptr<cached_response const>();
+        }
+        std::shared_ptr<cached_response const> entry(*i->second);
+        if (entry->expires <= now) {
+            evict(i->second);
+            return std::shared_ptr<cached_response const>();
+        }
+        lru.splice(lru.begin(), lru, i->second);
+        return entry;
+    }
+
+    void store(request_rec* r, apr_time_t ttl, std::string& body) {
+        std::vector<std::string> vary;
+        char const* header = apr_table_get(r->headers_out, "Vary");
+        while (header && *header) {
+            char* name = ap_get_token(r->pool, &header, 0);
+            if (!strcmp(name, "*")) {
+                return;
+            }
+            if (*name) {
+                vary.push_back(name);
+            }
+            while (*header == ',' || apr_isspace(*header)) {
+                ++header;
+            }
+        }
+
+        std::string url(ap_construct_url(r->pool, r->unparsed_uri, r));
+        std::shared_ptr<cached_response> entry(std::make_shared<cached_response>());
+        entry->url = url;
+        entry->key = key_of(r, url, vary);
+        entry->stored = apr_time_now();
+        entry->expires = entry->stored + ttl;
+        entry->mtime = r->mtime;
+        entry->content_type = r->content_type ? r->content_type : "";
+        apr_table_do(collect_cached_header, entry.get(), r->headers_out, NULL);
+        entry->body.swap(body);
+        if (entry->size() > capacity) {
+            return;
+        }
+
+        boost::lock_guard<boost::mutex> lock(mtx);
+        auto i = entries.find(entry->key);
+        if (i != entries.end()) {
+            evict(i->second);
+        }
+        used += entry->size();
+        while (used > capacity) {
+            evict(std::prev(lru.end()));
+        }
+        vary_entry& v = varies[url];
+        v.headers.swap(vary);
+        ++v.entries;
+        lru.push_front(entry);
+        entries[entry->key] = lru.begin();
+    }
+
+private:
+    static std::string key_of(request_rec* r, std::string const& url, std::vector<std::string> const& vary) {
+        std::string key(url);
+        for (auto const& name: vary) {
+            char const* value = apr_table_get(r->headers_in, name.c_str());
+            key += '\n';
+            key += name;
+            key += ':';
+            key += value ? value : "";
+        }
+        return key;
+    }
+
+    inline void evict(lru_list::iterator i) {
+        used -= (*i)->size();
+        entries.erase((*i)->key);
+        auto v = varies.find((*i)->url);
+        if (v != varies.end() && --v->second.entries == 0) {
+            varies.erase(v);
+        }
+        lru.erase(i);
+    }
+};
+
+// Per-child store behind Apache.kvGet, kvPut and kvDelete.  Keys are
+// spread over stripes, each with a lock, an LRU list and an equal share of
+// the capacity of its own, so that workers seldom wait on each other.
+// Expired entries are dropped as they are found or evicted.  An entry
+// larger than a stripe's share is refused.
+struct kv_store {
+    static const size_t stripe_count = 16;
+    // Bookkeeping charged to each entry on top of its key and value
+    static const size_t entry_overhead = 64;
+
+    struct entry {
+        std::string key;
+        std::shared_ptr<std::string const> value;
+        apr_time_t expires; // 0 for never
+    };
+    typedef std::list<entry> lru_list;
+
+    struct stripe {
+        boost::mutex mtx;
+        lru_list lru;
+        std::unordered_map<std::string, lru_list::iterator> entries;
+        size_t used;
+
+        inline stripe(): used(0) {}
+    };
+
+    size_t capacity; // of each stripe
+    stripe stripes[stripe_count];
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+    std::atomic<uint64_t> evictions;
+
+    inline kv_store(size_t capacity)
+        : capacity(capacity / stripe_count), hits(0), misses(0), evictions(0) {}
+
+    // Null if key is missing or expired
+    std::shared_ptr<std::string const> get(std::string const& key) {
+        stripe& s = stripe_of(key);
+        boost::lock_guard<boost::mutex> lock(s.mtx);
+        auto i = s.entries.find(key);
+        if (i == s.entries.end()) {
+            ++misses;
+            return std::shared_ptr<std::string const>();
+        }
+        if (i->second->expires && i->second->expires <= apr_time_now()) {
+            evict(s, i->second);
+            ++misses;
+            return std::shared_ptr<std::string const>();
+        }
+        ++hits;
+        s.lru.splice(s.lru.begin(), s.lru, i->second);
+        return i->second->value;
+    }
+
+    // Returns false, leaving what is stored under key alone, if the entry
+    // is too large to be kept
+    bool put(std::string const& key, std::shared_ptr<std::string const> const& value, apr_interval_time_t ttl) {
+        size_t size = size_of(key, *value);
+        if (size > capacity) {
+            return false;
+        }
+        stripe& s = stripe_of(key);
+        boost::lock_guard<boost::mutex> lock(s.mtx);
+        auto i = s.entries.find(key);
+        if (i != s.entries.end()) {
+            evict(s, i->second);
+        }
+        s.used += size;
+        while (s.used > capacity) {
+            evict(s, std::prev(s.lru.end()));
+            ++evictions;
+        }
+        entry e = { key, value, ttl ? apr_time_now() + ttl : 0 };
+        s.lru.push_front(e);
+        s.entries[key] = s.lru.begin();
+        return true;
+    }
+
+    void remove(std::string const& key) {
+        stripe& s = stripe_of(key);
+        boost::lock_guard<boost::mutex> lock(s.mtx);
+        auto i = s.entries.find(key);
+        if (i != s.entries.end()) {
+            evict(s, i->second);
+        }
+    }
+
+    // Entry count and bytes used, over all stripes
+    std::pair<size_t, size_t> usage() {
+        std::pair<size_t, size_t> result(0, 0);
+        for (auto& s: stripes) {
+            boost::lock_guard<boost::mutex> lock(s.mtx);
+            result.first += s.entries.size();
+            result.second += s.used;
+        }
+        return result;
+    }
+
+private:
+    static inline size_t size_of(std::string const& key, std::string const& value) {
+        return key.size() + value.size() + entry_overhead;
+    }
+
+    inline stripe& stripe_of(std::string const& key) {
+        return stripes[std::hash<std::string>()(key) % stripe_count];
+    }
+
+    static inline void evict(stripe& s, lru_list::iterator i) {
+        s.used -= size_of(i->key, *i->value);
+        s.entries.erase(i->key);
+        s.lru.erase(i);
+    }
+};
+
+const size_t kv_store::stripe_count;
+const size_t kv_store::entry_overhead;
+
+struct upstream_pool;
+
+// A connection to an upstream server.  Every operation on the socket runs
+// through the strand, as the child's I/O threads all serve the same
+// io_service.
+struct upstream_conn: public std::enable_shared_from_this<upstream_conn> {
+    upstream_pool* pool;
+    boost::asio::ip::tcp::socket socket;
+    boost::asio::io_service::strand strand;
+    apr_time_t idle_since;
+    // Writes queued by Apache.upstreamSend, the front one in progress
+    std::deque<std::string> outgoing;
+    bool failed;
+
+    inline upstream_conn(upstream_pool* pool, boost::asio::io_service& io)
+        : pool(pool), socket(io), strand(io), idle_since(0), failed(false) {}
+
+    inline void send(std::string&& data) {
+        std::shared_ptr<upstream_conn> self(shared_from_this());
+        std::shared_ptr<std::string> buf(std::make_shared<std::string>(std::move(data)));
+        strand.post([self, buf] () {
+            self->outgoing.push_back(std::string());
+            self->outgoing.back().swap(*buf);
+            if (self->outgoing.size() == 1) {
+                self->write_next();
+            }
+        });
+    }
+
+    // Calls done with what was read, or with NULL at the end of the stream
+    // or on an error
+    inline void receive(size_t max, std::function<void(std::shared_ptr<std::vector<char>> const&)> const& done) {
+        std::shared_ptr<upstream_conn> self(shared_from_this());
+        strand.post([self, max, done] () {
+            std::shared_ptr<std::vector<char>> buf(std::make_shared<std::vector<char>>(max));
+            self->socket.async_read_some(boost::asio::buffer(*buf), self->strand.wrap(
+                [self, buf, done] (boost::system::error_code const& ec, size_t n) {
+                    if (ec || !n) {
+                        self->failed = true;
+                        done(std::shared_ptr<std::vector<char>>());
+                    } else {
+                        buf->resize(n);
+                        done(buf);
+                    }
+                }));
+        });
+    }
+
+    // Whether an idle connection can be handed out again: the server must
+    // neither have closed it nor sent anything unasked for.
+    inline bool alive() {
+        boost::system::error_code ec;
+        char c;
+        socket.non_blocking(true, ec);
+        if (ec) {
+            return false;
+        }
+        socket.receive(boost::asio::buffer(&c, 1), boost::asio::socket_base::message_peek, ec);
+        bool idle = ec == boost::asio::error::would_block;
+        socket.non_blocking(false, ec);
+        return idle && !ec;
+    }
+
+private:
+    inline void write_next() {
+        std::shared_ptr<upstream_conn> self(shared_from_this());
+        boost::asio::async_write(socket, boost::asio::buffer(outgoing.front()), strand.wrap(
+            [self] (boost::system::error_code const& ec, size_t) {
+                if (ec) {
+                    self->failed = true;
+                    self->outgoing.clear();
+                    return;
+                }
+                self->outgoing.pop_front();
+                if (!self->outgoing.empty()) {
+                    self->write_next();
+                }
+            }));
+    }
+};
+
+// How OzUpstream configured a pool
+struct upstream_spec {
+    std::string name;
+    std::string host;
+    std::string port;
+    size_t max_conns;
+    apr_interval_time_t idle_timeout;
+    apr_interval_time_t check_interval;
+};
+
+// Per-child pool of connections to one upstream server, shared by every VM
+// of the child.  At most max_conns connections are open at once; checkouts
+// beyond that wait for one to be checked in.  Idle connections are closed
+// after idle_timeout, and checked every check_interval for having been
+// closed by the server.
+struct upstream_pool {
+    typedef std::function<void(std::shared_ptr<upstream_conn> const&)> checkout_handler;
+    // A checkout waiting for a connection, and who to drop it for
+    struct waiter {
+        void const* owner;
+        checkout_handler done;
+    };
+
+    upstream_spec spec;
+    boost::asio::io_service& io;
+    boost::asio::deadline_timer timer;
+    boost::mutex mtx;
+    std::deque<std::shared_ptr<upstream_conn>> idle;
+    std::deque<waiter> waiters;
+    size_t open; // idle, checked out or connecting
+    bool stopped;
+    // Counters
+    std::atomic<uint64_t> connects;
+    std::atomic<uint64_t> reuses;
+    std::atomic<uint64_t> failures;
+    std::atomic<uint64_t> dropped; // idle connections found dead or expired
+
+    inline upstream_pool(upstream_spec const& spec, boost::asio::io_service& io)
+        : spec(spec), io(io), timer(io), open(0), stopped(false),
+          connects(0), reuses(0), failures(0), dropped(0) {}
+
+    // Calls done with a connection, or with NULL if none could be made,
+    // unless forget(owner) is called first
+    inline void checkout(checkout_handler const& done, void const* owner) {
+        for (;;) {
+            std::shared_ptr<upstream_conn> conn;
+            {
+                boost::lock_guard<boost::mutex> lock(mtx);
+                if (!idle.empty()) {
+                    conn = idle.back();
+                    idle.pop_back();
+                } else if (spec.max_conns && open >= spec.max_conns) {
+                    waiter w = { owner, done };
+                    waiters.push_back(w);
+                    return;
+                } else {
+                    ++open;
+                }
+            }
+            if (!conn) {
+                connect(done);
+                return;
+            }
+            // Probed once out of the pool, so that other checkouts do not
+            // wait on the system calls
+            if (conn->alive()) {
+                ++reuses;
+                done(conn);
+                return;
+            }
+            ++dropped;
+            checkin(conn, false);
+        }
+    }
+
+    // Returns a connection to the pool, or closes it if it is not to be
+    // reused.  Either way a waiting checkout is served.
+    inline void checkin(std::shared_ptr<upstream_conn> const& conn, bool reuse) {
+        checkout_handler waiter;
+        {
+            boost::lock_guard<boost::mutex> lock(mtx);
+            if (!reuse || stopped) {
+                conn->socket.close();
+                --open;
+                if (waiters.empty() || stopped) {
+                    return;
+                }
+                ++open;
+                waiter = waiters.front().done;
+                waiters.pop_front();
+            } else if (!waiters.empty()) {
+                waiter = waiters.front().done;
+                waiters.pop_front();
+            } else {
+                conn->idle_since = apr_time_now();
+                idle.push_back(conn);
+                return;
+            }
+        }
+        if (reuse) {
+            ++reuses;
+            waiter(conn);
+        } else {
+            connect(waiter);
+        }
+    }
+
+    // Drops the checkouts of owner that are still waiting
+    inline void forget(void const* owner) {
+        boost::lock_guard<boost::mutex> lock(mtx);
+        for (auto i = waiters.begin(); i != waiters.end();) {
+            i = i->owner == owner ? waiters.erase(i) : std::next(i);
+        }
+    }
+
+    inline void start() {
+        schedule_sweep();
+    }
+
+    inline void stop() {
+        std::deque<waiter> orphans;
+        {
+            boost::lock_guard<boost::mutex> lock(mtx);
+            stopped = true;
+            for (auto const& conn: idle) {
+                conn->socket.close();
+            }
+            idle.clear();
+            orphans.swap(waiters);
+        }
+        boost::system::error_code ec;
+        timer.cancel(ec);
+        for (auto const& w: orphans) {
+            w.done(std::shared_ptr<upstream_conn>());
+        }
+    }
+
+private:
+    inline void connect(checkout_handler const& done) {
+        std::shared_ptr<boost::asio::ip::tcp::resolver> resolver(std::make_shared<boost::asio::ip::tcp::resolver>(io));
+        std::shared_ptr<upstream_conn> conn(std::make_shared<upstream_conn>(this, io));
+        upstream_pool* self = this;
+        resolver->async_resolve(boost::asio::ip::tcp::resolver::query(spec.host, spec.port),
+            [self, resolver, conn, done] (boost::system::error_code const& ec, boost::asio::ip::tcp::resolver::iterator i) {
+                if (ec) {
+                    self->connect_failed(done);
+                    return;
+                }
+                boost::asio::async_connect(conn->socket, i,
+                    [self, conn, done] (boost::system::error_code const& ec, boost::asio::ip::tcp::resolver::iterator) {
+                        if (ec) {
+                            self->connect_failed(done);
+                            return;
+                        }
+                        boost::system::error_code ignored;
+                        conn->socket.set_option(boost::asio::ip::tcp::no_delay(true), ignored);
+                        ++self->connects;
+                        done(conn);
+                    });
+            });
+    }
+
+    inline void connect_failed(checkout_handler const& done) {
+        ++failures;
+        {
+            boost::lock_guard<boost::mutex> lock(mtx);
+            --open;
+        }
+        done(std::shared_ptr<upstream_conn>());
+    }
+
+    inline void schedule_sweep() {
+        timer.expires_from_now(boost::posix_time::microseconds(spec.check_interval));
+        upstream_pool* self = this;
+        timer.async_wait([self] (boost::system::error_code const& ec) {
+            if (!ec) {
+                self->sweep();
+            }
+        });
+    }
+
+    // Takes each idle connection out of the pool in turn to probe it, so
+    // that checkouts do not wait on the system calls
+    inline void sweep() {
+        size_t n;
+        {
+            boost::lock_guard<boost::mutex> lock(mtx);
+            if (stopped) {
+                return;
+            }
+            n = idle.size();
+        }
+        for (; n > 0; --n) {
+            std::shared_ptr<upstream_conn> conn;
+            {
+                boost::lock_guard<boost::mutex> lock(mtx);
+                if (stopped) {
+                    return;
+                }
+                if (idle.empty()) {
+                    break;
+                }
+                conn = idle.front();
+                idle.pop_front();
+            }
+            if ((spec.idle_timeout && apr_time_now() - conn->idle_since >= spec.idle_timeout) || !conn->alive()) {
+                ++dropped;
+                checkin(conn, false);
+            } else {
+                requeue(conn);
+            }
+        }
+        schedule_sweep();
+    }
+
+    // Like checkin(conn, true), but keeps the time conn has been idle for
+    inline void requeue(std::shared_ptr<upstream_conn> const& conn) {
+        checkout_handler waiter;
+        {
+            boost::lock_guard<boost::mutex> lock(mtx);
+            if (stopped) {
+                conn->socket.close();
+                --open;
+                return;
+            }
+            if (waiters.empty()) {
+                idle.push_back(conn);
+                return;
+            }
+            waiter = waiters.front().done;
+            waiters.pop_front();
+        }
+        ++reuses;
+        waiter(conn);
+    }
+};
+
+// The upstream connections a request has checked out, by the number Oz
+// knows each by.  Only the VM thread touches it; I/O completions reach it
+// through VM events, and hold it by reference so that it outlives the
+// request if need be.  They are posted through post(), which drops them
+// once close() has cut the leases off from the VM, as the VM may be gone
+// by then.
+struct upstream_leases {
+    struct lease {
+        std::shared_ptr<upstream_conn> conn;
+        bool receiving;
+    };
+
+    bool closed;
+    mozart::nativeint next_id;
+    std::unordered_map<mozart::nativeint, lease> leases;
+    // Pools checked out from, for close() to drop waiting checkouts
+    std::unordered_set<upstream_pool*> pools;
+    boost::mutex vm_mtx;
+    mozart::boostenv::BoostVM* vm; // null once closed
+
+    inline upstream_leases(mozart::boostenv::BoostVM* vm): closed(false), next_id(0), vm(vm) {}
+
+    // Called from any thread: posts f to the VM, unless the leases are
+    // closed.  Returns whether f was posted.
+    inline bool post(std::function<void()> const& f) {
+        boost::lock_guard<boost::mutex> lock(vm_mtx);
+        if (!vm) {
+            return false;
+        }
+        vm->postVMEvent(f);
+        return true;
+    }
+
+    inline mozart::nativeint add(std::shared_ptr<upstream_conn> const& conn) {
+        lease l = { conn, false };
+        leases[next_id] = l;
+        return next_id++;
+    }
+
+    inline lease* find(mozart::nativeint id) {
+        auto i = leases.find(id);
+        return i == leases.end() ? 0 : &i->second;
+    }
+
+    inline void release(mozart::nativeint id, bool reuse) {
+        auto i = leases.find(id);
+        std::shared_ptr<upstream_conn> conn(i->second.conn);
+        reuse = reuse && !i->second.receiving;
+        leases.erase(i);
+        conn->strand.post([conn, reuse] () {
+            conn->pool->checkin(conn, reuse && !conn->failed && conn->outgoing.empty());
+        });
+    }
+
+    // Closes whatever the request left checked out
+    inline void close() {
+        {
+            boost::lock_guard<boost::mutex> lock(vm_mtx);
+            vm = 0;
+        }
+        for (upstream_pool* pool: pools) {
+            pool->forget(this);
+        }
+        closed = true;
+        while (!leases.empty()) {
+            release(leases.begin()->first, false);
+        }
+    }
+};
+
+// Text sent without being copied, such as the static parts of a compiled
+// template.  The buckets sending it share one of these, which keeps what
+// owns the text alive until the last of them is destroyed.
+struct shared_text {
+    apr_bucket_refcount refcount;
+    char const* base;
+    std::shared_ptr<void const> owner;
+};
+
+static void shared_text_bucket_destroy(void* data)
+{
+    shared_text* text = static_cast<shared_text*>(data);
+    if (apr_bucket_shared_destroy(text)) {
+        delete text;
+    }
+}
+
+static apr_status_t shared_text_bucket_read(apr_bucket* b, char const** str, apr_size_t* len, apr_read_type_e block)
+{
+    *str = static_cast<shared_text*>(b->data)->base + b->start;
+    *len = b->length;
+    return APR_SUCCESS;
+}
+
+static const apr_bucket_type_t shared_text_bucket_type = {
+    "WOZOZO_SHARED_TEXT", 5, apr_bucket_type_t::APR_BUCKET_DATA,
+    shared_text_bucket_destroy,
+    shared_text_bucket_read,
+    apr_bucket_setaside_noop,
+    apr_bucket_shared_split,
+    apr_bucket_shared_copy
+};
+
+// Makes a bucket of the len bytes at text->base, taking over text
+static apr_bucket* shared_text_bucket_create(shared_text* text, apr_size_t len, apr_bucket_alloc_t* list)
+{
+    apr_bucket* b = static_cast<apr_bucket*>(apr_bucket_alloc(sizeof(*b), list));
+    APR_BUCKET_INIT(b);
+    b->free = apr_bucket_free;
+    b->list = list;
+    b = apr_bucket_shared_make(b, text, 0, len);
+    b->type = &shared_text_bucket_type;
+    return b;
+}
+
+// Part of a file Apache.sendFile queued
+struct file_slice {
+    std::shared_ptr<open_file> file;
+    apr_off_t offset;
+};
+
+// The URIs of one Apache.subrequestsInOrder call, and the variables their
+// responses are bound to.  The worker runs them and posts each response to
+// vm, which is reset under mtx as the request is closed: the VM may be
+// gone after that.
+struct subrequest_batch {
+    struct response {
+        int status;
+        std::vector<std::pair<std::string, std::string>> headers;
+        std::string body;
+    };
+
+    boost::mutex mtx;
+    mozart::boostenv::BoostVM* vm;
+    std::vector<std::string> uris;
+    // Only touched on the VM thread; each is reset once bound
+    std::vector<mozart::ProtectedNode> results;
+
+    inline subrequest_batch(mozart::boostenv::BoostVM* vm): vm(vm) {}
+};
+
+static mozart::UnstableNode build_string(mozart::VM vm, char const* p);
+
+// Added to every Apache.subrequestsInOrder subrequest.  It is the last filter of
+// the subrequest's own, so that its output never reaches the protocol
+// filters it shares with the main request.
+static ap_filter_rec_t* subrequest_capture_filter = 0;
+
+// Keeps the body in the std::string the filter was added with
+static apr_status_t wozozo_subrequest_capture_filter(ap_filter_t* f, apr_bucket_brigade* bb)
+{
+    std::string* body = static_cast<std::string*>(f->ctx);
+    apr_status_t rv = APR_SUCCESS;
+    for (apr_bucket* b = APR_BRIGADE_FIRST(bb); b != APR_BRIGADE_SENTINEL(bb) && rv == APR_SUCCESS; b = APR_BUCKET_NEXT(b)) {
+        if (!APR_BUCKET_IS_METADATA(b)) {
+            char const* data;
+            apr_size_t len;
+            rv = apr_bucket_read(b, &data, &len, APR_BLOCK_READ);
+            if (rv == APR_SUCCESS) {
+                body->append(data, len);
+            }
+        }
+    }
+    apr_brigade_cleanup(bb);
+    return rv;
+}
+
+static int collect_subrequest_header(void* data, char const* key, char const* value)
+{
+    static_cast<std::vector<std::pair<std::string, std::string>>*>(data)->push_back(std::make_pair(key, value));
+    return 1;
+}
+
+static apr_status_t release_open_file(void* data)
+{
+    delete static_cast<std::shared_ptr<open_file>*>(data);
+    return APR_SUCCESS;
+}
+
+// Single-producer/single-consumer channel carrying output operations from
+// a VM thread to the Apache worker that owns the request, so that the VM
+// never calls into the filter chain itself.  The producer batches data
+// into chunks of chunk_size bytes before queueing them, and is held back
+// while more than high_water_mark bytes are waiting to be written.  A
+// resident VM's thread must not block, so its builtins park the Oz thread
+// with park_producer() instead, and enqueue only waits for a full queue.
+struct output_channel {
+    static const size_t chunk_size = 8192;
+    static const size_t queue_capacity = 1024;
+
+    struct op {
+        enum kind_t { DATA, SHARED, FILE, FLUSH, CONTENT_TYPE, STATUS, HEADERS, READ, CACHE, ETAG, LAST_MODIFIED, SUBREQUESTS } kind;
+        // malloc()ed and owned by whoever holds the op, except for SHARED,
+        // where shared owns the text
+        char* data;
+        // The value itself for STATUS, the most to read for READ, seconds
+        // for CACHE and LAST_MODIFIED
+        size_t len;
+        shared_text* shared;
+        file_slice* file; // owned by whoever holds the op
+        std::shared_ptr<subrequest_batch>* subrequests; // likewise
+    };
+
+    boost::lockfree::spsc_queue<op> queue;
+    size_t high_water_mark;
+    std::atomic<size_t> queued_bytes;
+    std::atomic<bool> closed;
+    std::atomic<bool> consumer_waiting;
+    std::atomic<bool> producer_waiting;
+    // Set by a consumer that does not wait but has on_ready called instead
+    std::atomic<bool> parked;
+    std::function<void()> on_ready;
+    bool nonblocking_producer;
+    // Set by a producer that does not wait but has on_drained called instead
+    std::atomic<bool> producer_parked;
+    std::function<void()> on_drained;
+    boost::mutex mtx;
+    boost::condition_variable cond;
+
+    // Chunk being filled by the producer
+    char* chunk;
+    size_t chunk_len;
+    size_t chunk_cap;
+
+    // Chunks filled and shared text written since mark(), held back until
+    // release()
+    struct held_op {
+        op o;
+        size_t cap; // of a chunk
+    };
+    bool holding;
+    bool mark_chunk; // whether the chunk current at mark() is the first held
+    size_t mark_len;
+    std::vector<held_op> held;
+
+    inline output_channel(size_t high_water_mark)
+        : queue(queue_capacity), high_water_mark(high_water_mark), queued_bytes(0),
+          closed(false), consumer_waiting(false), producer_waiting(false), parked(false),
+          nonblocking_producer(false), producer_parked(false), chunk(0), chunk_len(0), chunk_cap(0), holding(false), mark_chunk(false), mark_len(0) {}
+
+    inline ~output_channel() {
+        op o;
+        while (queue.pop(o)) {
+            discard(o);
+        }
+        for (auto& h: held) {
+            discard(h.o);
+        }
+        free(chunk);
+    }
+
+    static inline void discard(op& o) {
+        if (o.kind == op::SHARED) {
+            delete o.shared;
+        } else if (o.kind == op::FILE) {
+            delete o.file;
+        } else if (o.kind == op::SUBREQUESTS) {
+            delete o.subrequests;
+        } else {
+            free(o.data);
+        }
+    }
+
+    // Producer side
+
+    inline char* reserve(size_t n) {
+        if (chunk && chunk_cap - chunk_len >= n) {
+            return chunk + chunk_len;
+        }
+        push_chunk();
+        chunk_cap = std::max(n, chunk_size);
+        chunk = static_cast<char*>(malloc(chunk_cap));
+        if (!chunk) {
+            throw std::bad_alloc();
+        }
+        return chunk;
+    }
+
+    inline void commit(size_t n) {
+        chunk_len += n;
+    }
+
+    inline void write(char const* p, size_t n) {
+        while (n > 0) {
+            size_t l = std::min(n, chunk_size);
+            std::copy_n(p, l, reserve(l));
+            commit(l);
+            p += l;
+            n -= l;
+        }
+    }
+
+    // Queues the len bytes at p to be sent as they are rather than copied.
+    // owner keeps them alive.
+    inline void write_shared(char const* p, size_t len, std::shared_ptr<void const> const& owner) {
+        push_chunk();
+        shared_text* shared = new shared_text;
+        shared->base = p;
+        shared->owner = owner;
+        op o = { op::SHARED, const_cast<char*>(p), len, shared, 0, 0 };
+        hold_or_enqueue(o);
+    }
+
+    // Queues len bytes of file from offset, for the worker to send as a
+    // file bucket
+    inline void send_file(std::shared_ptr<open_file> const& file, apr_off_t offset, size_t len) {
+        push_chunk();
+        file_slice* slice = new file_slice;
+        slice->file = file;
+        slice->offset = offset;
+        op o = { op::FILE, 0, len, 0, slice, 0 };
+        hold_or_enqueue(o);
+    }
+
+    inline void flush() {
+        push_chunk();
+        enqueue(op::FLUSH, 0, 0);
+    }
+
+    // Starts holding back everything written, so that it can be dropped
+    // with rollback() or queued with release().
+    inline void mark() {
+        holding = true;
+        mark_chunk = chunk != 0;
+        mark_len = chunk_len;
+    }
+
+    inline void rollback() {
+        if (!held.empty()) {
+            free(chunk);
+            chunk = 0;
+            chunk_cap = 0;
+            size_t i = 0;
+            if (mark_chunk) {
+                chunk = held[0].o.data;
+                chunk_cap = held[0].cap;
+                i = 1;
+            }
+            for (; i < held.size(); ++i) {
+                discard(held[i].o);
+            }
+            held.clear();
+        }
+        chunk_len = mark_len;
+        holding = false;
+    }
+
+    inline void release() {
+        holding = false;
+        for (auto const& h: held) {
+            enqueue(h.o);
+        }
+        held.clear();
+    }
+
+    inline void set_content_type(std::string const& value) {
+        push_chunk();
+        enqueue(op::CONTENT_TYPE, copy_of(value), value.size());
+    }
+
+    inline void set_status(int status) {
+        push_chunk();
+        enqueue(op::STATUS, 0, static_cast<size_t>(status));
+    }
+
+    inline void cache_for(size_t seconds) {
+        push_chunk();
+        enqueue(op::CACHE, 0, seconds);
+    }
+
+    inline void set_etag(std::string const& value) {
+        push_chunk();
+        enqueue(op::ETAG, copy_of(value), value.size());
+    }
+
+    inline void set_last_modified(size_t seconds) {
+        push_chunk();
+        enqueue(op::LAST_MODIFIED, 0, seconds);
+    }
+
+    // Asks the worker for the next chunk of the request body
+    inline void read(size_t max) {
+        push_chunk();
+        enqueue(op::READ, 0, max);
+    }
+
+    // Asks the worker to run the batch's subrequests
+    inline void run_subrequests(std::shared_ptr<subrequest_batch> const& batch) {
+        push_chunk();
+        op o = { op::SUBREQUESTS, 0, 0, 0, 0, new std::shared_ptr<subrequest_batch>(batch) };
+        enqueue(o);
+    }
+
+    // headers holds NUL-terminated names and values, alternately
+    inline void set_headers(std::string const& headers) {
+        push_chunk();
+        enqueue(op::HEADERS, copy_of(headers), headers.size());
+    }
+
+    inline void close() {
+        push_chunk();
+        closed.store(true);
+        wake_consumer();
+    }
+
+    inline bool over_high_water_mark() const {
+        return queue.write_available() == 0 || queued_bytes.load() > high_water_mark;
+    }
+
+    // Instead of blocking, has the consumer call on_drained once the queue
+    // is back under high_water_mark.  Returns false, and does not park, if
+    // it already is.
+    inline bool park_producer() {
+        producer_parked.store(true);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!over_high_water_mark()) {
+            return !producer_parked.exchange(false);
+        }
+        return true;
+    }
+
+    // Consumer side
+
+    inline bool pop(op& o) {
+        if (!queue.pop(o)) {
+            return false;
+        }
+        if (o.kind == op::DATA) {
+            queued_bytes.fetch_sub(o.len);
+        }
+        // Orders the pop before reading the producer's flags, which it sets
+        // before checking the queue again
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (producer_waiting.load()) {
+            boost::lock_guard<boost::mutex> lock(mtx);
+            cond.notify_all();
+        }
+        if (producer_parked.load() && !over_high_water_mark() && producer_parked.exchange(false)) {
+            on_drained();
+        }
+        return true;
+    }
+
+    // Blocks until there is something to pop or the producer is done.
+    inline void wait() {
+        boost::unique_lock<boost::mutex> lock(mtx);
+        consumer_waiting.store(true);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        while (queue.read_available() == 0 && !closed.load()) {
+            cond.wait(lock);
+        }
+        consumer_waiting.store(false);
+    }
+
+    // Like wait(), but gives up after timeout
+    inline void wait_for(apr_interval_time_t timeout) {
+        boost::unique_lock<boost::mutex> lock(mtx);
+        consumer_waiting.store(true);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        cond.wait_for(lock, boost::chrono::microseconds(timeout), [this] {
+            return queue.read_available() > 0 || closed.load();
+        });
+        consumer_waiting.store(false);
+    }
+
+    // Instead of waiting, has the producer call on_ready once there is
+    // something to pop or it is done.  Returns false, and does not park,
+    // if there already is.
+    inline bool park() {
+        parked.store(true);
+        if (queue.read_available() > 0 || closed.load()) {
+            return !parked.exchange(false);
+        }
+        return true;
+    }
+
+    // Takes a park() back.  Returns false if on_ready has been called or
+    // is about to be.
+    inline bool unpark() {
+        return parked.exchange(false);
+    }
+
+private:
+    static inline char* copy_of(std::string const& value) {
+        char* data = static_cast<char*>(malloc(value.size()));
+        if (!data) {
+            throw std::bad_alloc();
+        }
+        std::copy(value.begin(), value.end(), data);
+        return data;
+    }
+
+    inline void push_chunk() {
+        if (holding && chunk) {
+            held_op h = { { op::DATA, chunk, chunk_len, 0, 0, 0 }, chunk_cap };
+            held.push_back(h);
+        } else if (chunk_len > 0) {
+            enqueue(op::DATA, chunk, chunk_len);
+        } else {
+            free(chunk);
+        }
+        chunk = 0;
+        chunk_len = chunk_cap = 0;
+    }
+
+    inline void enqueue(op::kind_t kind, char* data, size_t len) {
+        op o = { kind, data, len, 0, 0, 0 };
+        enqueue(o);
+    }
+
+    inline void hold_or_enqueue(op const& o) {
+        if (holding) {
+            held_op h = { o, 0 };
+            held.push_back(h);
+        } else {
+            enqueue(o);
+        }
+    }
+
+    inline bool must_wait() const {
+        return queue.write_available() == 0 || (!nonblocking_producer && queued_bytes.load() > high_water_mark);
+    }
+
+    inline void enqueue(op const& o) {
+        if (must_wait()) {
+            boost::unique_lock<boost::mutex> lock(mtx);
+            producer_waiting.store(true);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            while (must_wait()) {
+                cond.wait(lock);
+            }
+            producer_waiting.store(false);
+        }
+        if (o.kind == op::DATA) {
+            queued_bytes.fetch_add(o.len);
+        }
+        queue.push(o);
+        wake_consumer();
+    }
+
+    inline void wake_consumer() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (consumer_waiting.load()) {
+            boost::lock_guard<boost::mutex> lock(mtx);
+            cond.notify_all();
+        }
+        if (parked.load() && parked.exchange(false)) {
+            on_ready();
+        }
+    }
+};
+
+const size_t output_channel::chunk_size;
+const size_t output_channel::queue_capacity;
+
+// Where the time of one request went, in microseconds.  The boot phases
+// are only set when the request paid for booting a VM of its own.
+struct request_metrics {
+    apr_interval_time_t boot_base;
+    apr_interval_time_t boot_init;
+    apr_interval_time_t app_load;
+    apr_interval_time_t run;
+    size_t heap;
+    uint64_t bytes_written;
+    uint64_t flushes;        // Apache.rflush calls
+    uint64_t flushes_sent;   // flushes passed down the filter chain
+    bool booted;
+
+    inline request_metrics()
+        : boot_base(0), boot_init(0), app_load(0), run(0), heap(0), bytes_written(0),
+          flushes(0), flushes_sent(0), booted(false) {}
+};
+
+// The parts of the request Apache.request and Apache.getHeader read, taken
+// by the worker before it hands the request to a VM.  The VM must not read
+// them from the request_rec, as the input filters the worker runs for
+// Apache.read may merge trailers into headers_in meanwhile.
+struct request_fields {
+    char const* method;
+    char const* uri;
+    char const* unparsed_uri;
+    char const* args;
+    char const* useragent_ip;
+    char const* protocol;
+    char const* hostname;
+    char const* filename;
+    char const* path_info;
+    apr_table_t const* headers_in;
+
+    inline request_fields(request_rec* r)
+        : method(r->method), uri(r->uri), unparsed_uri(r->unparsed_uri), args(r->args),
+          useragent_ip(r->useragent_ip), protocol(r->protocol), hostname(r->hostname),
+          filename(r->filename), path_info(r->path_info),
+          headers_in(apr_table_copy(r->pool, r->headers_in)) {}
+};
+
+// Everything a VM needs to serve one request.  Owned by the Apache worker,
+// which pumps the output channel until the VM closes it.
+struct request_context {
+    request_rec* r;
+    request_fields request;
+    output_channel out;
+    // Values Apache.request has already converted, by feature.  Only the
+    // VM thread touches these, and it drops them in close().
+    std::unordered_map<std::string, mozart::ProtectedNode> fields;
+    // The outstanding Apache.read, if any, and the VM to hand its result to
+    size_t read_chunk_size;
+    mozart::boostenv::BoostVM* reader;
+    // (shared with the event that binds it, which may outlive the context)
+    std::shared_ptr<mozart::ProtectedNode> pending_read;
+    // On a resident VM, what the Oz threads writing the response wait on
+    // while the worker catches up, and the node out.on_drained binds
+    mozart::boostenv::BoostVM* writer;
+    mozart::ProtectedNode drained;
+    std::shared_ptr<mozart::ProtectedNode> pending_drain;
+    // Upstream connections checked out while serving the request
+    std::shared_ptr<upstream_leases> upstreams;
+    // Apache.subrequestsInOrder batches, for close() to cut off from the VM
+    std::vector<std::shared_ptr<subrequest_batch>> subrequests;
+    // Worker side of the body reader
+    apr_bucket_brigade* body;
+    bool body_eos;
+    // Worker side of the response cache: what the VM wrote so far, kept
+    // once Apache.cacheFor is called before any output
+    size_t max_cache_entry_size;
+    apr_interval_time_t cache_ttl;
+    std::string captured;
+    bool output_started;
+    bool has_validators;
+    bool conditions_checked;
+    int status; // set when the response was answered from the validators
+    // Flush policy: an Apache.rflush is passed on once flush_min_bytes have
+    // been written since the last flush, or flush_max_delay after it was
+    // asked for, whichever comes first
+    bool flush_every; // pass on every flush where it was asked for
+    size_t flush_min_bytes;
+    apr_interval_time_t flush_max_delay;
+    size_t unflushed;
+    bool flush_pending;
+    apr_time_t flush_deadline;
+    // The VM serving the request attaches what cancels it while it does.
+    // The worker cancels it when the client goes away or at the deadline.
+    boost::mutex cancel_mtx;
+    std::function<void()> canceler;
+    char const* canceled; // why, once canceled
+    apr_time_t deadline;  // 0 for none
+    // Worker side of pump_once()
+    apr_bucket_brigade* bb;
+    apr_status_t rv;        // of the last write to the client
+    apr_time_t next_check;  // of whether the client is still there
+    bool sent;              // whether anything went down the filter chain
+    // Filled in by the VM, except for bytes_written and the flush counts,
+    // before it closes the channel
+    request_metrics metrics;
+
+    inline request_context(request_rec* r, mozart_vm_args_t const& args)
+        : r(r), request(r), out(args.output_high_water_mark), read_chunk_size(args.read_chunk_size),
+          reader(0), writer(0), body(0), body_eos(false),
+          max_cache_entry_size(args.response_cache_size ? args.response_cache_max_entry_size : 0),
+          cache_ttl(0), output_started(false), has_validators(false), conditions_checked(false),
+          status(OK), flush_every(false), flush_min_bytes(0), flush_max_delay(default_flush_max_delay), unflushed(0),
+          flush_pending(false), flush_deadline(0), canceled(0), deadline(0),
+          bb(0), rv(APR_SUCCESS), next_check(0), sent(false) {}
+
+    // Called by the VM thread as it takes the request on
+    inline void attach(std::function<void()> const& f) {
+        boost::lock_guard<boost::mutex> lock(cancel_mtx);
+        canceler = f;
+        if (canceled) {
+            canceler();
+        }
+    }
+
+    // Called by the VM thread as it is done with the request.  Returns
+    // whether the request was canceled, in which case the canceler may
+    // have been run.
+    inline bool detach() {
+        boost::lock_guard<boost::mutex> lock(cancel_mtx);
+        canceler = std::function<void()>();
+        return canceled != 0;
+    }
+
+    // Called by the VM when it is done with the request.  Nothing may touch
+    // the context afterwards.
+    inline void close() {
+        detach();
+        fields.clear();
+        release_read();
+        release_drain();
+        if (upstreams) {
+            upstreams->close();
+        }
+        for (auto const& batch: subrequests) {
+            boost::lock_guard<boost::mutex> lock(batch->mtx);
+            batch->vm = 0;
+            batch->results.clear();
+        }
+        subrequests.clear();
+        out.close();
+    }
+
+    // Runs on the VM thread: binds an outstanding Apache.read to unit so the
+    // VM does not keep waiting for it
+    inline void release_read() {
+        if (pending_read && *pending_read) {
+            mozart::ProtectedNode node(std::move(*pending_read));
+            pending_read->reset();
+            mozart::UnstableNode value = mozart::build(reader->vm, mozart::unit);
+            reader->bindAndReleaseAsyncIOFeedbackNode(node, value);
+        }
+        pending_read.reset();
+    }
+
+    // Runs on a resident VM's thread before writing: suspends the calling
+    // Oz thread, rather than the VM, while the worker has more than the
+    // high-water mark of output queued
+    inline void throttle(mozart::VM vm) {
+        mozart::boostenv::BoostVM* boostVM = &mozart::boostenv::BoostVM::forVM(vm);
+        if (!pending_drain) {
+            std::shared_ptr<mozart::ProtectedNode> pending(std::make_shared<mozart::ProtectedNode>());
+            pending_drain = pending;
+            out.on_drained = [boostVM, pending] () {
+                boostVM->postVMEvent([boostVM, pending] () {
+                    if (*pending) {
+                        mozart::ProtectedNode node(std::move(*pending));
+                        pending->reset();
+                        mozart::UnstableNode value = mozart::build(boostVM->vm, mozart::unit);
+                        boostVM->bindAndReleaseAsyncIOFeedbackNode(node, value);
+                    }
+                });
+            };
+        }
+        if (!*pending_drain) {
+            if (!out.over_high_water_mark()) {
+                return;
+            }
+            mozart::UnstableNode readOnly;
+            *pending_drain = boostVM->createAsyncIOFeedbackNode(readOnly);
+            drained = vm->protect(readOnly);
+            writer = boostVM;
+            if (!out.park_producer()) {
+                release_drain();
+                return;
+            }
+        }
+        mozart::waitFor(vm, *drained);
+    }
+
+    // Runs on the VM thread: wakes whatever throttle() suspended
+    inline void release_drain() {
+        if (pending_drain && *pending_drain) {
+            mozart::ProtectedNode node(std::move(*pending_drain));
+            pending_drain->reset();
+            mozart::UnstableNode value = mozart::build(writer->vm, mozart::unit);
+            writer->bindAndReleaseAsyncIOFeedbackNode(node, value);
+        }
+        drained.reset();
+    }
+
+    // Runs on the VM thread of a resident VM canceling the request: binds
+    // whatever Apache.subrequestsInOrder is still waiting for to unit
+    inline void abandon_subrequests(mozart::boostenv::BoostVM* vm) {
+        for (auto const& batch: subrequests) {
+            for (auto& node: batch->results) {
+                if (node) {
+                    mozart::ProtectedNode n(std::move(node));
+                    node.reset();
+                    mozart::UnstableNode value = mozart::build(vm->vm, mozart::unit);
+                    vm->bindAndReleaseAsyncIOFeedbackNode(n, value);
+                }
+            }
+        }
+    }
+
+    // Runs on the worker thread: passes everything the VM writes down the
+    // filter chain until the channel is closed.
+    inline void pump() {
+        apr_time_t wake;
+        while (!pump_once(wake)) {
+            out.wait_for(std::max<apr_interval_time_t>(wake - apr_time_now(), 0));
+        }
+    }
+
+    // Passes down what the VM has written so far.  Returns true once the
+    // channel is closed and drained; otherwise sets wake to when it should
+    // be called again at the latest, whether or not the VM writes more.
+    inline bool pump_once(apr_time_t& wake) {
+        if (!bb) {
+            bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+            next_check = apr_time_now() + abort_check_interval;
+        }
+        bool closed = out.closed.load();
+        output_channel::op o;
+        while (out.pop(o)) {
+            switch (o.kind) {
+            case output_channel::op::DATA:
+            case output_channel::op::SHARED:
+                output_started = true;
+                metrics.bytes_written += o.len;
+                unflushed += o.len;
+                if (cache_ttl) {
+                    if (captured.size() + o.len <= max_cache_entry_size) {
+                        captured.append(o.data, o.len);
+                    } else {
+                        cache_ttl = 0;
+                        std::string().swap(captured);
+                    }
+                }
+                if (rv != APR_SUCCESS) {
+                    output_channel::discard(o);
+                } else if (o.kind == output_channel::op::SHARED) {
+                    APR_BRIGADE_INSERT_TAIL(bb, shared_text_bucket_create(o.shared, o.len, bb->bucket_alloc));
+                } else {
+                    APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_heap_create(o.data, o.len, free, bb->bucket_alloc));
+                }
+                break;
+            case output_channel::op::FILE:
+                output_started = true;
+                metrics.bytes_written += o.len;
+                unflushed += o.len;
+                if (cache_ttl) {
+                    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "Apache.sendFile called; not caching");
+                    cache_ttl = 0;
+                    std::string().swap(captured);
+                }
+                if (rv == APR_SUCCESS) {
+                    insert_file(*o.file, o.len);
+                }
+                delete o.file;
+                break;
+            case output_channel::op::FLUSH:
+                ++metrics.flushes;
+                if (flush_every) {
+                    APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_flush_create(bb->bucket_alloc));
+                    ++metrics.flushes_sent;
+                    unflushed = 0;
+                } else if (!flush_pending) {
+                    flush_pending = true;
+                    flush_deadline = apr_time_now() + flush_max_delay;
+                }
+                break;
+            case output_channel::op::CONTENT_TYPE:
+                ap_set_content_type(r, apr_pstrmemdup(r->pool, o.data, o.len));
+                free(o.data);
+                break;
+            case output_channel::op::STATUS:
+                r->status = static_cast<int>(o.len);
+                break;
+            case output_channel::op::HEADERS:
+                set_headers(o.data, o.len);
+                free(o.data);
+                break;
+            case output_channel::op::READ:
+                // Once canceled or closed, the VM side gives up on the read
+                // itself
+                if (!canceled && !closed) {
+                    read_body(o.len);
+                }
+                break;
+            case output_channel::op::CACHE:
+                if (output_started) {
+                    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "Apache.cacheFor called after output; not caching");
+                } else if (max_cache_entry_size) {
+                    cache_ttl = apr_time_from_sec(o.len);
+                }
+                break;
+            case output_channel::op::ETAG:
+                apr_table_set(r->headers_out, "ETag", apr_pstrmemdup(r->pool, o.data, o.len));
+                has_validators = true;
+                free(o.data);
+                break;
+            case output_channel::op::LAST_MODIFIED:
+                ap_update_mtime(r, apr_time_from_sec(o.len));
+                ap_set_last_modified(r);
+                has_validators = true;
+                break;
+            case output_channel::op::SUBREQUESTS:
+                // Once canceled, the VM side gives up on them itself
+                if (!canceled) {
+                    run_subrequests(*o.subrequests);
+                }
+                delete o.subrequests;
+                break;
+            }
+        }
+        if (flush_pending && (unflushed >= flush_min_bytes || apr_time_now() >= flush_deadline)) {
+            APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_flush_create(bb->bucket_alloc));
+            ++metrics.flushes_sent;
+            flush_pending = false;
+            unflushed = 0;
+        }
+        // One pass per batch, however many operations it coalesced
+        if (!APR_BRIGADE_EMPTY(bb)) {
+            check_conditions();
+            if (rv == APR_SUCCESS && status == OK) {
+                rv = ap_pass_brigade(r->output_filters, bb);
+                sent = true;
+                if (rv != APR_SUCCESS) {
+                    ap_log_rerror(APLOG_MARK, APLOG_INFO, rv, r, "could not write response; discarding further output");
+                }
+            }
+            apr_brigade_cleanup(bb);
+        }
+        if (closed) {
+            check_conditions();
+            if (rv != APR_SUCCESS) {
+                cache_ttl = 0;
+            }
+            return true;
+        }
+        check_canceled();
+        wake = next_check;
+        if (flush_pending) {
+            wake = std::min(wake, flush_deadline);
+        }
+        if (deadline && !canceled) {
+            wake = std::min(wake, deadline);
+        }
+        return false;
+    }
+
+private:
+    // Cancels the request if the client went away or it is past its
+    // deadline
+    inline void check_canceled() {
+        if (canceled) {
+            return;
+        }
+        apr_time_t now = apr_time_now();
+        if (rv != APR_SUCCESS || r->connection->aborted) {
+            cancel("the client went away");
+        } else if (deadline && now >= deadline) {
+            cancel("it ran past OzRequestTimeout");
+            if (!output_started) {
+                conditions_checked = true;
+                status = HTTP_GATEWAY_TIME_OUT;
+            }
+        } else if (now >= next_check) {
+            next_check = now + abort_check_interval;
+            if (client_gone()) {
+                cancel("the client closed the connection");
+            }
+        }
+        if (canceled) {
+            rv = APR_ECONNABORTED;
+            cache_ttl = 0;
+        }
+    }
+
+    inline void cancel(char const* reason) {
+        ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "canceling %s: %s", r->filename, reason);
+        boost::lock_guard<boost::mutex> lock(cancel_mtx);
+        canceled = reason;
+        if (canceler) {
+            canceler();
+        }
+    }
+
+    // Whether the client has closed its end, short of reading the
+    // connection
+    inline bool client_gone() {
+        apr_socket_t* sock = ap_get_conn_socket(r->connection);
+        int eof = 0;
+        return sock && apr_socket_atreadeof(sock, &eof) == APR_SUCCESS && eof;
+    }
+
+    // Appends len bytes of the slice's file to bb as file buckets, which
+    // the core output filter hands to sendfile(2) or maps as EnableSendfile
+    // and EnableMMAP allow.  The file is kept open until the request ends.
+    inline void insert_file(file_slice const& slice, size_t len) {
+        std::shared_ptr<open_file>* pin = new std::shared_ptr<open_file>(slice.file);
+        apr_pool_cleanup_register(r->pool, pin, release_open_file, apr_pool_cleanup_null);
+        apr_bucket* b = apr_brigade_insert_file(bb, slice.file->fd, slice.offset, len, r->pool);
+#if APR_HAS_MMAP
+        core_dir_config* core_conf = static_cast<core_dir_config*>(ap_get_core_module_config(r->per_dir_config));
+        if (core_conf->enable_mmap == ENABLE_MMAP_OFF) {
+            apr_bucket_file_enable_mmap(b, 0);
+        }
+#endif
+    }
+
+    // Runs the subrequests one after the other, and posts each response to
+    // the VM as soon as it is complete.  Their bodies are captured by
+    // WOZOZO_SUBREQUEST rather than sent.  The request is checked for
+    // abort and timeout between them, as nothing else is meanwhile.
+    inline void run_subrequests(std::shared_ptr<subrequest_batch> const& batch) {
+        for (size_t i = 0; i < batch->uris.size(); ++i) {
+            if (i > 0) {
+                check_canceled();
+            }
+            if (canceled) {
+                break;
+            }
+            std::shared_ptr<subrequest_batch::response> response(std::make_shared<subrequest_batch::response>());
+            request_rec* rr = ap_sub_req_lookup_uri(batch->uris[i].c_str(), r, NULL);
+            response->status = rr->status;
+            if (rr->status == HTTP_OK) {
+                ap_add_output_filter_handle(subrequest_capture_filter, &response->body, rr, rr->connection);
+                int rv = ap_run_sub_req(rr);
+                response->status = ap_is_HTTP_ERROR(rv) ? rv : rr->status;
+                if (rr->content_type) {
+                    response->headers.push_back(std::make_pair("Content-Type", rr->content_type));
+                }
+                apr_table_do(collect_subrequest_header, &response->headers, rr->headers_out, NULL);
+            }
+            ap_destroy_sub_req(rr);
+
+            boost::lock_guard<boost::mutex> lock(batch->mtx);
+            if (!batch->vm) {
+                break;
+            }
+            mozart::boostenv::BoostVM* vm = batch->vm;
+            std::shared_ptr<subrequest_batch> self(batch);
+            vm->postVMEvent([vm, self, i, response] () {
+                if (i >= self->results.size() || !self->results[i]) {
+                    return;
+                }
+                mozart::ProtectedNode node(std::move(self->results[i]));
+                self->results[i].reset();
+                mozart::UnstableNode headers = mozart::build(vm->vm, vm->vm->coreatoms.nil);
+                for (auto h = response->headers.rbegin(); h != response->headers.rend(); ++h) {
+                    headers = mozart::buildCons(vm->vm, mozart::buildSharp(vm->vm, build_string(vm->vm, h->first.c_str()), build_string(vm->vm, h->second.c_str())), std::move(headers));
+                }
+                mozart::UnstableNode value = mozart::buildRecord(vm->vm,
+                    mozart::buildArity(vm->vm, "response", "body", "headers", "status"),
+                    mozart::ByteString::build(vm->vm, mozart::newLString(vm->vm, reinterpret_cast<unsigned char const*>(response->body.data()), static_cast<mozart::nativeint>(response->body.size()))),
+                    std::move(headers), response->status);
+                vm->bindAndReleaseAsyncIOFeedbackNode(node, value);
+            });
+        }
+    }
+
+    // Before anything is sent, answers conditional requests from the
+    // validators the VM has set; the rest of its output is then dropped.
+    inline void check_conditions() {
+        if (conditions_checked) {
+            return;
+        }
+        conditions_checked = true;
+        if (has_validators && r->status == HTTP_OK) {
+            status = ap_meets_conditions(r);
+            if (status != OK) {
+                cache_ttl = 0;
+            }
+        }
+    }
+
+    // Reads at most max bytes of the body and binds the VM's pending read
+    // to them, or to unit once the body is exhausted.  Only one chunk is in
+    // flight at a time, so the client is throttled by the Oz side.
+    inline void read_body(size_t max) {
+        char* data = 0;
+        apr_size_t len = 0;
+        while (!len && !body_eos) {
+            if (!body) {
+                body = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+            }
+            apr_status_t rv = ap_get_brigade(r->input_filters, body, AP_MODE_READBYTES, APR_BLOCK_READ, max);
+            if (rv != APR_SUCCESS) {
+                ap_log_rerror(APLOG_MARK, APLOG_INFO, rv, r, "could not read request body");
+                body_eos = true;
+                break;
+            }
+            for (apr_bucket* b = APR_BRIGADE_FIRST(body); b != APR_BRIGADE_SENTINEL(body); b = APR_BUCKET_NEXT(b)) {
+                if (APR_BUCKET_IS_EOS(b)) {
+                    body_eos = true;
+                }
+            }
+            apr_off_t n = 0;
+            apr_brigade_length(body, 1, &n);
+            if (n > 0) {
+                data = static_cast<char*>(malloc(n));
+                len = static_cast<apr_size_t>(n);
+                apr_brigade_flatten(body, data, &len);
+            }
+            apr_brigade_cleanup(body);
+        }
+
+        mozart::boostenv::BoostVM* vm = reader;
+        std::shared_ptr<mozart::ProtectedNode> pending(pending_read);
+        vm->postVMEvent([vm, pending, data, len] () {
+            if (!*pending) {
+                // The request was closed in the meantime
+                free(data);
+                return;
+            }
+            mozart::UnstableNode value = data ?
+                mozart::ByteString::build(vm->vm, mozart::newLString(vm->vm, reinterpret_cast<unsigned char const*>(data), static_cast<mozart::nativeint>(len))) :
+                mozart::build(vm->vm, mozart::unit);
+            free(data);
+            mozart::ProtectedNode node(std::move(*pending));
+            pending->reset();
+            vm->bindAndReleaseAsyncIOFeedbackNode(node, value);
+        });
+    }
+
+    inline void set_headers(char const* p, size_t len) {
+        char const* end = p + len;
+        while (p < end) {
+            char const* name = p;
+            p += strlen(p) + 1;
+            char const* value = p;
+            p += strlen(p) + 1;
+            if (!strcasecmp(name, "Content-Type")) {
+                ap_set_content_type(r, apr_pstrdup(r->pool, value));
+            } else if (!strcasecmp(name, "Set-Cookie")) {
+                apr_table_add(r->headers_out, name, value);
+            } else {
+                apr_table_set(r->headers_out, name, value);
+            }
+        }
+    }
+};
+
+struct vm_pool;
+
+struct heap_profile;
+
+struct resident_app;
+
+struct _string: public std::string {
+    request_context* ctx;
+    condvar* c;
+    vm_pool* pool;
+    std::string* image;
+    std::shared_ptr<functor_image> functor;
+    heap_profile* profile; // where to record the heap the job used, if anywhere
+    std::shared_ptr<resident_app> resident;
+    int status;
+    inline _string(request_context* ctx, char const* s): std::string(s), ctx(ctx), c(0), pool(0), image(0), profile(0), status(OK) {}
+    // Boots a VM that keeps the application at s loaded for resident
+    inline _string(std::shared_ptr<resident_app> const& resident, char const* s): std::string(s), ctx(0), c(0), pool(0), image(0), profile(0), resident(resident), status(OK) {}
+    inline _string(vm_pool* pool): std::string(), ctx(0), c(0), pool(pool), image(0), profile(0), status(OK) {}
+    // Boots a VM that only pickles its Init functor into image
+    inline _string(condvar* c, std::string* image): std::string(), ctx(0), c(c), pool(0), image(image), profile(0), status(OK) {}
+
+    // Tells whoever is waiting on this job that the VM is done with it.
+    // Nothing may touch the job afterwards.
+    inline void finish() {
+        if (ctx) {
+            ctx->close();
+        } else if (c) {
+            c->notify();
+        }
+    }
+};
+
+// The Init functor, already applied to Base, in pickled form.  Either
+// mapped from OzBootImage, so that every child shares the same pages, or
+// held in buffer when the image could not be written out.
+struct boot_image {
+    char const* data;
+    size_t size;
+    std::string buffer;
+
+    inline boot_image(): data(0), size(0) {}
+};
+
+struct membuf: public std::streambuf {
+    inline membuf(char const* data, size_t size) {
+        char* p = const_cast<char*>(data);
+        setg(p, p, p + size);
+    }
+};
+
+// A set of Mozart VMs that have Base and Init loaded before any request
+// arrives.  Each pooled VM takes jobs one at a time and, after serving
+// max_requests of them, retires and spawns its own replacement.
+struct vm_pool {
+    mozart::boostenv::BoostEnvironment* env;
+    mozart::VirtualMachineOptions options;
+    size_t max_requests;
+    boost::mutex mtx;
+    boost::condition_variable cond;
+    std::deque<_string*> jobs;
+    size_t live;
+    bool shutting_down;
+
+    inline vm_pool(mozart::boostenv::BoostEnvironment* env, mozart::VirtualMachineOptions const& options, size_t max_requests)
+        : env(env), options(options), max_requests(max_requests), live(0), shutting_down(false) {}
+
+    inline void spawn() {
+        {
+            boost::lock_guard<boost::mutex> lock(mtx);
+            if (shutting_down) {
+                return;
+            }
+            ++live;
+        }
+        env->addVM(1, std::move(std::unique_ptr<std::string>(new _string(this))), true, options);
+    }
+
+    inline bool submit(_string* job) {
+        {
+            boost::lock_guard<boost::mutex> lock(mtx);
+            if (shutting_down || !live) {
+                return false;
+            }
+            jobs.push_back(job);
+        }
+        cond.notify_one();
+        return true;
+    }
+
+    // Called from a pooled VM thread; blocks until a job arrives or the
+    // pool is shut down, in which case NULL is returned.
+    inline _string* take() {
+        boost::unique_lock<boost::mutex> lock(mtx);
+        while (jobs.empty() && !shutting_down) {
+            cond.wait(lock);
+        }
+        if (shutting_down) {
+            return 0;
+        }
+        _string* job = jobs.front();
+        jobs.pop_front();
+        return job;
+    }
+
+    inline void retire(bool respawn) {
+        std::deque<_string*> orphans;
+        {
+            boost::lock_guard<boost::mutex> lock(mtx);
+            --live;
+            if (!respawn && !live) {
+                // nobody is left to serve the queued jobs
+                orphans.swap(jobs);
+            }
+        }
+        for (_string* job: orphans) {
+            job->status = HTTP_SERVICE_UNAVAILABLE;
+            job->finish();
+        }
+        if (respawn) {
+            spawn();
+        }
+    }
+
+    inline void shutdown() {
+        std::deque<_string*> orphans;
+        {
+            boost::lock_guard<boost::mutex> lock(mtx);
+            shutting_down = true;
+            orphans.swap(jobs);
+        }
+        cond.notify_all();
+        for (_string* job: orphans) {
+            job->status = HTTP_SERVICE_UNAVAILABLE;
+            job->finish();
+        }
+    }
+};
+
+// A resident VM: one that has loaded its application once, and runs each
+// request handed to it in an Oz thread of its own, calling the procedure
+// the application gave to Apache.serve.  Apart from the BoostVM pointer,
+// which is set before the VM is made known to its resident_app, everything
+// here belongs to the VM thread.
+struct resident_vm {
+    struct request {
+        request_context* ctx;
+        apr_time_t started;
+    };
+
+    resident_app* app;
+    mozart::boostenv::BoostVM* boost;
+    mozart::ProtectedNode handler;
+    // Held until the VM is told to stop, so that it keeps running while no
+    // request is in flight
+    mozart::ProtectedNode keep_alive;
+    mozart::nativeint next_id;
+    std::unordered_map<mozart::nativeint, request> requests;
+    // Which request each Oz thread that called Apache.adopt is serving.
+    // The threads are held as Oz values rather than by address, as the GC
+    // moves them, and holding them keeps a dead thread's address from
+    // being given to a new one.
+    struct adoption {
+        mozart::ProtectedNode thread;
+        mozart::nativeint id;
+    };
+    std::vector<adoption> threads;
+
+    inline resident_vm(resident_app* app): app(app), boost(0), next_id(0) {}
+
+    // Runs on the VM thread: starts the handler on a request
+    inline void start(request_context* ctx) {
+        mozart::VM vm = boost->vm;
+        mozart::nativeint id = next_id++;
+        request req = { ctx, apr_time_now() };
+        requests[id] = req;
+        mozart::ozcalls::asyncOzCall(vm, *handler, mozart::build(vm, id));
+        if (current_node) {
+            ++current_node->requests;
+        }
+        // Canceling only drops the request; the VM serves others
+        resident_vm* self = this;
+        mozart::boostenv::BoostVM* boostVM = boost;
+        ctx->attach([self, boostVM, id] () {
+            boostVM->postVMEvent([self, id] () {
+                self->cancel(id);
+            });
+        });
+    }
+
+    static inline mozart::Runnable* thread_of(adoption const& a) {
+        return mozart::RichNode(*a.thread).as<mozart::ReifiedThread>().value();
+    }
+
+    inline adoption* adoption_of(mozart::Runnable* thread) {
+        for (auto& a: threads) {
+            if (thread_of(a) == thread) {
+                return &a;
+            }
+        }
+        return 0;
+    }
+
+    inline request_context* adopt(mozart::VM vm, mozart::Runnable* thread, mozart::nativeint id) {
+        auto i = requests.find(id);
+        if (i == requests.end()) {
+            return 0;
+        }
+        // Threads that died without calling Apache.finish are let go here
+        threads.erase(std::remove_if(threads.begin(), threads.end(), [] (adoption const& a) {
+            return thread_of(a)->isTerminated();
+        }), threads.end());
+        adoption* a = adoption_of(thread);
+        if (a) {
+            a->id = id;
+        } else {
+            adoption b = { vm->protect(mozart::ReifiedThread::build(vm, thread)), id };
+            threads.push_back(std::move(b));
+        }
+        return i->second.ctx;
+    }
+
+    inline request_context* request_of(mozart::Runnable* thread) {
+        adoption* a = adoption_of(thread);
+        if (!a) {
+            return 0;
+        }
+        auto i = requests.find(a->id);
+        return i == requests.end() ? 0 : i->second.ctx;
+    }
+
+    // Hands the request the thread is serving back to its worker, and
+    // detaches every thread that adopted it
+    inline bool finish(mozart::Runnable* thread) {
+        adoption* a = adoption_of(thread);
+        if (!a) {
+            return false;
+        }
+        end(a->id);
+        return true;
+    }
+
+    // Runs on the VM thread: ends a canceled request, waking its handler
+    // if it is waiting for the request body
+    inline void cancel(mozart::nativeint id) {
+        auto i = requests.find(id);
+        if (i == requests.end()) {
+            return;
+        }
+        request_context* ctx = i->second.ctx;
+        ctx->abandon_subrequests(boost);
+        ctx->release_read();
+        end(id);
+    }
+
+    inline void end(mozart::nativeint id) {
+        threads.erase(std::remove_if(threads.begin(), threads.end(), [id] (adoption const& a) {
+            return a.id == id;
+        }), threads.end());
+        auto i = requests.find(id);
+        if (i == requests.end()) {
+            return;
+        }
+        request_context* ctx = i->second.ctx;
+        ctx->metrics.run = apr_time_now() - i->second.started;
+        ctx->metrics.heap = boost->vm->getMemoryManager().getAllocated();
+        requests.erase(i);
+        ctx->close();
+    }
+
+    // Runs on the VM thread once nothing is left running on it.  Requests
+    // whose handler died without calling Apache.finish are failed.
+    inline void abandon() {
+        threads.clear();
+        for (auto& i: requests) {
+            i.second.ctx->status = HTTP_INTERNAL_SERVER_ERROR;
+            i.second.ctx->close();
+        }
+        requests.clear();
+        handler.reset();
+    }
+
+    // Runs on the VM thread: lets the VM end once its handlers are done
+    inline void stop() {
+        if (keep_alive) {
+            mozart::ProtectedNode node(std::move(keep_alive));
+            keep_alive.reset();
+            mozart::UnstableNode value = mozart::build(boost->vm, mozart::unit);
+            boost->bindAndReleaseAsyncIOFeedbackNode(node, value);
+        }
+    }
+};
+
+// The resident VMs of one script.  Requests are handed to them in turn,
+// waiting for them to boot if need be.  When the script changes on disk the
+// application is retired: its VMs finish what they are running and stop.
+struct resident_app {
+    apr_time_t mtime;
+    boost::mutex mtx;
+    boost::condition_variable cond;
+    size_t starting;
+    std::vector<resident_vm*> ready;
+    size_t next;
+    bool retired;
+
+    inline resident_app(apr_time_t mtime, size_t vms)
+        : mtime(mtime), starting(vms), next(0), retired(false) {}
+
+    // Called from Apache.serve on the VM thread
+    inline void up(resident_vm* vm) {
+        {
+            boost::lock_guard<boost::mutex> lock(mtx);
+            --starting;
+            if (retired) {
+                vm->stop();
+            } else {
+                ready.push_back(vm);
+            }
+        }
+        cond.notify_all();
+    }
+
+    // Called by the VM thread as it ends, whether or not it came up
+    inline void down(resident_vm* vm) {
+        {
+            boost::lock_guard<boost::mutex> lock(mtx);
+            auto i = std::find(ready.begin(), ready.end(), vm);
+            if (i != ready.end()) {
+                ready.erase(i);
+            } else if (!vm->boost) {
+                --starting;
+            }
+        }
+        cond.notify_all();
+    }
+
+    // Returns false if no VM of the application is, or will be, serving.
+    // The request is posted under the lock, so the VM cannot go away
+    // before the request reaches it.
+    inline bool dispatch(request_context* ctx) {
+        boost::unique_lock<boost::mutex> lock(mtx);
+        while (ready.empty() && starting && !retired) {
+            cond.wait(lock);
+        }
+        if (ready.empty() || retired) {
+            return false;
+        }
+        resident_vm* vm = ready[next++ % ready.size()];
+        vm->boost->postVMEvent([vm, ctx] () {
+            vm->start(ctx);
+        });
+        return true;
+    }
+
+    inline void retire() {
+        boost::lock_guard<boost::mutex> lock(mtx);
+        retired = true;
+        for (resident_vm* vm: ready) {
+            vm->boost->postVMEvent([vm] () {
+                vm->stop();
+            });
+        }
+        ready.clear();
+        cond.notify_all();
+    }
+};
+
+// Resident applications of the child, by script
+struct resident_registry {
+    boost::mutex mtx;
+    std::unordered_map<std::string, std::shared_ptr<resident_app>> apps;
+
+    // The application serving the script, and whether it was just created
+    // and so has VMs to be started
+    inline std::shared_ptr<resident_app> get(std::string const& script, apr_time_t mtime, size_t vms, bool& created) {
+        std::shared_ptr<resident_app> stale;
+        std::shared_ptr<resident_app> app;
+        {
+            boost::lock_guard<boost::mutex> lock(mtx);
+            std::shared_ptr<resident_app>& entry = apps[script];
+            if (entry && entry->mtime != mtime) {
+                stale.swap(entry);
+            }
+            created = !entry;
+            if (created) {
+                entry = std::make_shared<resident_app>(mtime, vms);
+            }
+            app = entry;
+        }
+        if (stale) {
+            stale->retire();
+        }
+        return app;
+    }
+
+    inline void shutdown() {
+        boost::lock_guard<boost::mutex> lock(mtx);
+        for (auto& i: apps) {
+            i.second->retire();
+        }
+        apps.clear();
+    }
+
+    inline size_t ready_vms() {
+        size_t n = 0;
+        boost::lock_guard<boost::mutex> lock(mtx);
+        for (auto& i: apps) {
+            boost::lock_guard<boost::mutex> app_lock(i.second->mtx);
+            n += i.second->ready.size();
+        }
+        return n;
+    }
+};
+
+// Bounds the number of VMs running requests at once.  Requests beyond that
+// wait in line, up to depth of them (0 for no limit) and for at most
+// timeout (0 for no limit); the rest are turned away before they cost a VM.
+struct admission_gate {
+    size_t limit;
+    size_t depth;
+    apr_interval_time_t timeout;
+    boost::mutex mtx;
+    boost::condition_variable cond;
+    size_t running;
+    size_t waiting;
+    // Counters
+    std::atomic<uint64_t> admitted;
+    std::atomic<uint64_t> rejected;
+    std::atomic<uint64_t> timed_out;
+    std::atomic<uint64_t> total_wait; // microseconds
+
+    inline admission_gate(size_t limit, size_t depth, apr_interval_time_t timeout)
+        : limit(limit), depth(depth), timeout(timeout), running(0), waiting(0),
+          admitted(0), rejected(0), timed_out(0), total_wait(0) {}
+
+    // Returns false if the request is to be turned away.  waited is set to
+    // the time spent in line either way.
+    inline bool enter(apr_interval_time_t& waited) {
+        apr_time_t start = apr_time_now();
+        boost::unique_lock<boost::mutex> lock(mtx);
+        waited = 0;
+        if (running < limit) {
+            ++running;
+            ++admitted;
+            return true;
+        }
+        if (depth && waiting >= depth) {
+            ++rejected;
+            return false;
+        }
+        ++waiting;
+        bool ok = true;
+        if (timeout) {
+            ok = cond.wait_for(lock, boost::chrono::microseconds(timeout), [this] { return running < limit; });
+        } else {
+            cond.wait(lock, [this] { return running < limit; });
+        }
+        --waiting;
+        waited = apr_time_now() - start;
+        total_wait += waited;
+        if (!ok) {
+            ++timed_out;
+            return false;
+        }
+        ++running;
+        ++admitted;
+        return true;
+    }
+
+    inline void leave() {
+        {
+            boost::lock_guard<boost::mutex> lock(mtx);
+            --running;
+        }
+        cond.notify_one();
+    }
+};
+
+// The most heap each script was seen to use, for sizing the VMs that run
+// it under OzHeapAutoTune.
+struct heap_profile {
+    boost::mutex mtx;
+    std::unordered_map<std::string, size_t> peaks;
+
+    inline size_t peak_of(std::string const& script) {
+        boost::lock_guard<boost::mutex> lock(mtx);
+        auto i = peaks.find(script);
+        return i == peaks.end() ? 0 : i->second;
+    }
+
+    inline void record(std::string const& script, size_t used) {
+        boost::lock_guard<boost::mutex> lock(mtx);
+        size_t& peak = peaks[script];
+        peak = std::max(peak, used);
+    }
+
+    // A quarter of headroom over the peak, in whole megabytes, and always
+    // leaving room for growth below max
+    static inline size_t heap_size_for(size_t peak, size_t max) {
+        size_t size = (peak + peak / 4 + mozart::MegaBytes - 1) / mozart::MegaBytes * mozart::MegaBytes;
+        return std::max(mozart::MegaBytes, std::min(size, max - mozart::MegaBytes));
+    }
+};
+
+// Counters of one Mozart I/O thread.  asio does not expose its ready
+// queue, so its depth is measured by how many handlers the thread finds
+// waiting each time it wakes up.
+struct io_thread_stats {
+    std::atomic<uint64_t> handled;   // handlers run
+    std::atomic<uint64_t> wakeups;   // times the thread had to wait for work
+    std::atomic<uint64_t> last_depth;
+    std::atomic<uint64_t> max_depth;
+
+    inline io_thread_stats(): handled(0), wakeups(0), last_depth(0), max_depth(0) {}
+
+    inline void record(uint64_t depth) {
+        handled += depth;
+        ++wakeups;
+        last_depth = depth;
+        uint64_t max = max_depth.load();
+        while (depth > max && !max_depth.compare_exchange_weak(max, depth));
+    }
+};
+
+// Counts of durations in buckets doubling from 1ms up; the last bucket
+// holds everything longer.
+struct latency_histogram {
+    static const size_t buckets = 16;
+    std::atomic<uint64_t> counts[buckets + 1];
+    std::atomic<uint64_t> total; // microseconds
+
+    inline latency_histogram(): total(0) {
+        for (auto& count: counts) {
+            count = 0;
+        }
+    }
+
+    inline void record(apr_interval_time_t t) {
+        size_t i = 0;
+        for (apr_interval_time_t bound = 1000; i < buckets && t > bound; bound *= 2) {
+            ++i;
+        }
+        ++counts[i];
+        total += t;
+    }
+};
+
+// Aggregates of everything the child has served, for wozozo-status
+struct child_stats {
+    std::atomic<uint64_t> requests;
+    std::atomic<uint64_t> cache_hits;
+    std::atomic<long> active_vms;
+    std::atomic<uint64_t> bytes_written;
+    std::atomic<uint64_t> flushes;
+    std::atomic<uint64_t> flushes_sent;
+    std::atomic<uint64_t> canceled;
+    std::atomic<size_t> peak_heap;
+    latency_histogram queue_wait;
+    latency_histogram boot;
+    latency_histogram app_load;
+    latency_histogram run;
+
+    inline child_stats()
+        : requests(0), cache_hits(0), active_vms(0), bytes_written(0), flushes(0), flushes_sent(0), canceled(0), peak_heap(0) {}
+
+    inline void record(request_metrics const& metrics) {
+        if (metrics.booted) {
+            boot.record(metrics.boot_base + metrics.boot_init);
+        }
+        app_load.record(metrics.app_load);
+        run.record(metrics.run);
+        bytes_written += metrics.bytes_written;
+        flushes += metrics.flushes;
+        flushes_sent += metrics.flushes_sent;
+        size_t peak = peak_heap.load();
+        while (metrics.heap > peak && !peak_heap.compare_exchange_weak(peak, metrics.heap));
+    }
+};
+
+// Opt-in sampling profiler (OzProfile).  Each VM thread publishes in a
+// slot the script it runs and the builtin or phase it is in; a thread of
+// the child reads the slots rate times a second and counts the folded
+// stacks it finds.  Outside builtins, a VM whose thread used CPU since the
+// last sample is running Oz code, and one that did not is waiting.  When
+// profiling is off all this costs builtins a null pointer test.
+struct profiler {
+    enum builtin_id {
+        SET_CONTENT_TYPE, RPUTS, RPUTS_HTML_ESCAPED, RPUTS_URL_ENCODED, RPUTS_BASE64, RPUTS_JSON,
+        RENDER, SEND_FILE, RFLUSH, READ, SUBREQUESTS, UPSTREAM, UPSTREAM_SEND, UPSTREAM_RECEIVE, KV_GET, KV_PUT,
+        KV_DELETE, builtin_count
+    };
+
+    struct builtin_stats {
+        std::atomic<uint64_t> calls;
+        std::atomic<uint64_t> total; // microseconds
+        std::atomic<uint64_t> max;
+
+        inline builtin_stats(): calls(0), total(0), max(0) {}
+    };
+
+    struct slot {
+        std::atomic<char const*> script; // interned; null while idle
+        std::atomic<char const*> frame;  // null while in Oz code
+#ifndef MOZART_WINDOWS
+        clockid_t clock;
+        uint64_t cpu; // at the last sample
+#endif
+
+        inline slot(): script(0), frame(0) {}
+    };
+
+    static char const* builtin_name(builtin_id id) {
+        static char const* const names[] = {
+            "Apache.setContentType", "Apache.rputs", "Apache.rputsHtmlEscaped", "Apache.rputsUrlEncoded",
+            "Apache.rputsBase64", "Apache.rputsJson", "Apache.render", "Apache.sendFile", "Apache.rflush",
+            "Apache.read", "Apache.subrequestsInOrder", "Apache.upstream", "Apache.upstreamSend", "Apache.upstreamReceive",
+            "Apache.kvGet", "Apache.kvPut", "Apache.kvDelete"
+        };
+        return names[id];
+    }
+
+    apr_interval_time_t interval;
+    builtin_stats builtins[builtin_count];
+    boost::mutex mtx;
+    boost::condition_variable cond;
+    bool stopping;
+    std::unordered_set<std::string> scripts;
+    std::list<slot> slots;
+    std::unordered_map<std::string, uint64_t> samples; // by folded stack
+    std::unique_ptr<boost::thread> thread;
+
+    inline profiler(size_t rate): interval(1000000 / rate), stopping(false) {}
+
+    // Called by a VM thread as it starts, and leave()s before it ends
+    slot* enter() {
+        boost::lock_guard<boost::mutex> lock(mtx);
+        slots.emplace_back();
+        slot* s = &slots.back();
+#ifndef MOZART_WINDOWS
+        pthread_getcpuclockid(pthread_self(), &s->clock);
+        s->cpu = cpu_of(*s);
+#endif
+        return s;
+    }
+
+    void leave(slot* s) {
+        boost::lock_guard<boost::mutex> lock(mtx);
+        for (auto i = slots.begin(); i != slots.end(); ++i) {
+            if (&*i == s) {
+                slots.erase(i);
+                break;
+            }
+        }
+    }
+
+    // A copy of script that lives as long as the profiler
+    char const* intern(char const* script) {
+        boost::lock_guard<boost::mutex> lock(mtx);
+        return scripts.insert(script).first->c_str();
+    }
+
+    inline void record(builtin_id id, apr_interval_time_t elapsed) {
+        builtin_stats& stats = builtins[id];
+        ++stats.calls;
+        stats.total += elapsed;
+        uint64_t max = stats.max.load();
+        while (static_cast<uint64_t>(elapsed) > max && !stats.max.compare_exchange_weak(max, elapsed));
+    }
+
+    void start() {
+        thread.reset(new boost::thread([this] () {
+            boost::unique_lock<boost::mutex> lock(mtx);
+            while (!stopping) {
+                cond.wait_for(lock, boost::chrono::microseconds(interval));
+                if (!stopping) {
+                    sample();
+                }
+            }
+        }));
+    }
+
+    void stop() {
+        {
+            boost::lock_guard<boost::mutex> lock(mtx);
+            stopping = true;
+            cond.notify_all();
+        }
+        if (thread) {
+            thread->join();
+        }
+    }
+
+    // Writes the samples as "frame;frame count" lines, the input of
+    // flamegraph.pl, and clears them if asked to
+    void dump(request_rec* r, bool reset) {
+        std::unordered_map<std::string, uint64_t> taken;
+        {
+            boost::lock_guard<boost::mutex> lock(mtx);
+            if (reset) {
+                taken.swap(samples);
+            } else {
+                taken = samples;
+            }
+        }
+        for (auto const& i: taken) {
+            ap_rprintf(r, "%s %" APR_UINT64_T_FMT "\n", i.first.c_str(), i.second);
+        }
+    }
+
+private:
+    // With mtx held
+    void sample() {
+        for (auto& s: slots) {
+            char const* script = s.script.load();
+            char const* frame = s.frame.load();
+#ifndef MOZART_WINDOWS
+            uint64_t cpu = cpu_of(s);
+            if (!frame) {
+                frame = cpu != s.cpu ? "(oz)" : "(waiting)";
+            }
+            s.cpu = cpu;
+#else
+            if (!frame) {
+                frame = "(oz)";
+            }
+#endif
+            if (script) {
+                ++samples[std::string(script) + ";" + frame];
+            }
+        }
+    }
+
+#ifndef MOZART_WINDOWS
+    static uint64_t cpu_of(slot const& s) {
+        struct timespec ts;
+        if (clock_gettime(s.clock, &ts)) {
+            return 0;
+        }
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
+#endif
+};
+
+// The profiler of the child, while OzProfile is on
+static profiler* active_profiler = 0;
+
+// The slot of the VM running on this thread, while profiling
+static thread_local profiler::slot* current_slot = 0;
+
+// Shows the script a VM thread runs, and the phase it is in, in samples
+static void profile_phase(char const* script, char const* frame)
+{
+    if (current_slot) {
+        current_slot->frame.store(frame);
+        current_slot->script.store(script ? active_profiler->intern(script) : 0);
+    }
+}
+
+// Times a builtin call and shows it in samples, while profiling
+struct profile_scope {
+    profiler::slot* slot;
+    profiler::builtin_id id;
+    char const* outer;
+    apr_time_t start;
+
+    inline profile_scope(profiler::builtin_id id): slot(current_slot), id(id) {
+        if (slot) {
+            start = apr_time_now();
+            outer = slot->frame.exchange(profiler::builtin_name(id));
+        }
+    }
+
+    inline ~profile_scope() {
+        if (slot) {
+            slot->frame.store(outer);
+            active_profiler->record(id, apr_time_now() - start);
+        }
+    }
+};
+
+typedef struct wozozo_server_conf_t {
+    mozart_vm_args_t vm_args;
+    std::shared_ptr<mozart::boostenv::BoostEnvironment> env;
+    std::vector<std::unique_ptr<boost::thread>> io_threads;
+    std::deque<io_thread_stats> io_stats;
+    std::unique_ptr<boost::asio::io_service::work> work;
+    std::unique_ptr<vm_pool> pool;
+    std::unique_ptr<admission_gate> gate;
+    std::unique_ptr<response_cache> cache;
+    std::unique_ptr<kv_store> kv;
+    std::unique_ptr<file_cache> files;
+    std::unique_ptr<profiler> prof; // while OzProfile is on
+    resident_registry residents;
+    std::vector<upstream_spec> upstream_specs;
+    std::unordered_map<std::string, std::unique_ptr<upstream_pool>> upstreams;
+    heap_profile heap_profiles;
+    std::shared_ptr<child_stats> stats;
+    std::shared_ptr<cpu_placement> placement; // if any of OzVMCPUs, OzIOCPUs and OzNUMA is set
+    std::shared_ptr<boot_image> image;
+    functor_cache functors;
+    template_cache templates;
+    server_rec* server;
+    bool async_mpm; // whether the MPM can resume suspended requests
+
+    wozozo_server_conf_t(): stats(std::make_shared<child_stats>()), image(std::make_shared<boot_image>()), server(0), async_mpm(false) {}
+} wozozo_server_conf_t;
+
+
+static mozart::boostenv::BoostEnvironment* init_mozart_vm_env(server_rec *s, mozart_vm_args_t const& args, std::shared_ptr<boot_image> const& image, std::shared_ptr<child_stats> const& stats,
+                                                              std::shared_ptr<cpu_placement> const& placement);
+static void prepare_boot_image(apr_pool_t *pool, server_rec *s, wozozo_server_conf_t* conf);
+static int check_mozart_vm_args(server_rec *s, mozart_vm_args_t const& args);
+
+extern "C" {
+extern module AP_MODULE_DECLARE_DATA wozozo_module;
+
+static const char* register_oz_root(cmd_parms* cmd, void* dummy, const char* path)
+{
+    server_rec* s = cmd->server;
+    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(s->module_config, &wozozo_module));
+    conf->vm_args.oz_home = path;
+    return NULL;
+}
+
+static const char* register_oz_search_path(cmd_parms* cmd, void* dummy, const char* path)
+{
+    server_rec* s = cmd->server;
+    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(s->module_config, &wozozo_module));
+    conf->vm_args.oz_search_path = path;
+    return NULL;
+}
+
+static const char* register_oz_search_load(cmd_parms* cmd, void* dummy, const char* path)
+{
+    server_rec* s = cmd->server;
+    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(s->module_config, &wozozo_module));
+    conf->vm_args.oz_search_load = path;
+    return NULL;
+}
+
+static const char* register_init_functor_path(cmd_parms* cmd, void* dummy, const char* path)
+{
+    server_rec* s = cmd->server;
+    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(s->module_config, &wozozo_module));
+    conf->vm_args.init_functor_path = path;
+    return NULL;
+}
+
+static const char* register_base_functor_path(cmd_parms* cmd, void* dummy, const char* path)
+{
+    server_rec* s = cmd->server;
+    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(s->module_config, &wozozo_module));
+    conf->vm_args.base_functor_path = path;
+    return NULL;
+}
+
+
+static const char* register_boot_image_path(cmd_parms* cmd, void* dummy, const char* path)
+{
+    server_rec* s = cmd->server;
+    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(s->module_config, &wozozo_module));
+    conf->vm_args.boot_image_path = path;
+    return NULL;
+}
+
+
+static const char* register_functor_cache(cmd_parms* cmd, void* dummy, int flag)
+{
+    server_rec* s = cmd->server;
+    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(s->module_config, &wozozo_module));
+    conf->vm_args.functor_cache = flag;
+    return NULL;
+}
+
+
+static const char* register_max_memory(cmd_parms* cmd, void* dummy, const char* value)
+{
+    server_rec* s = cmd->server;
+    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(s->module_config, &wozozo_module));
+    apr_off_t _value;
+    if (apr_strtoff(&_value, value, NULL, 10) || _value <= 0) {
+        return "Invalid value for OzMaxMemory.";
+    }
+    if (cmd->path) {
+        static_cast<wozozo_dir_conf_t*>(dummy)->max_memory = static_cast<size_t>(_value);
+    } else {
+        conf->vm_args.max_memory = static_cast<size_t>(_value);
+    }
+    return NULL;
+}
+
+
+static const char* register_min_memory(cmd_parms* cmd, void* dummy, const char* value)
+{
+    server_rec* s = cmd->server;
+    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(s->module_config, &wozozo_module));
+    apr_off_t _value;
+    if (apr_strtoff(&_value, value, NULL, 10) || _value <= 0) {
+        return "Invalid value for OzMinMemory.";
+    }
+    if (cmd->path) {
+        static_cast<wozozo_dir_conf_t*>(dummy)->min_memory = static_cast<size_t>(_value);
+    } else {
+        conf->vm_args.min_memory = static_cast<size_t>(_value);
+    }
+    return NULL;
+}
+
+static const char* register_heap_auto_tune(cmd_parms* cmd, void* dummy, int flag)
+{
+    static_cast<wozozo_dir_conf_t*>(dummy)->heap_auto_tune = flag;
+    return NULL;
+}
+
+static const char* register_flush_min_bytes(cmd_parms* cmd, void* dummy, const char* value)
+{
+    apr_off_t _value;
+    if (apr_strtoff(&_value, value, NULL, 10) || _value < 0) {
+        return "Invalid value for OzFlushMinBytes.";
+    }
+    static_cast<wozozo_dir_conf_t*>(dummy)->flush_min_bytes = _value;
+    return NULL;
+}
+
+static const char* register_flush_max_delay(cmd_parms* cmd, void* dummy, const char* value)
+{
+    apr_interval_time_t _value;
+    if (ap_timeout_parameter_parse(value, &_value, "ms") != APR_SUCCESS || _value < 0) {
+        return "Invalid value for OzFlushMaxDelay.";
+    }
+    static_cast<wozozo_dir_conf_t*>(dummy)->flush_max_delay = _value;
+    return NULL;
+}
+
+static const char* register_flush_every(cmd_parms* cmd, void* dummy, int flag)
+{
+    static_cast<wozozo_dir_conf_t*>(dummy)->flush_every = flag;
+    return NULL;
+}
+
+static const char* register_suspend(cmd_parms* cmd, void* dummy, int flag)
+{
+    static_cast<wozozo_dir_conf_t*>(dummy)->suspend = flag;
+    return NULL;
+}
+
+static const char* register_request_timeout(cmd_parms* cmd, void* dummy, const char* value)
+{
+    apr_interval_time_t _value;
+    if (ap_timeout_parameter_parse(value, &_value, "s") != APR_SUCCESS || _value < 0) {
+        return "Invalid value for OzRequestTimeout.";
+    }
+    static_cast<wozozo_dir_conf_t*>(dummy)->request_timeout = _value;
+    return NULL;
+}
+
+static const char* register_resident_vms(cmd_parms* cmd, void* dummy, const char* value)
+{
+    apr_off_t _value;
+    if (apr_strtoff(&_value, value, NULL, 10) || _value < 0 || _value > 1024) {
+        return "Invalid value for OzResidentVMs.";
+    }
+    static_cast<wozozo_dir_conf_t*>(dummy)->resident_vms = static_cast<int>(_value);
+    return NULL;
+}
+
+
+static const char* register_io_threads(cmd_parms* cmd, void* dummy, const char* value)
+{
+    server_rec* s = cmd->server;
+    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(s->module_config, &wozozo_module));
+    apr_off_t _value;
+    if (apr_strtoff(&_value, value, NULL, 10) || _value <= 0) {
+        return "Invalid value for OzIOThreads.";
+    }
+    conf->vm_args.io_threads = static_cast<size_t>(_value);
+    return NULL;
+}
+
+static const char* register_max_vms(cmd_parms* cmd, void* dummy, const char* value)
+{
+    server_rec* s = cmd->server;
+    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(s->module_config, &wozozo_module));
+    apr_off_t _value;
+    if (apr_strtoff(&_value, value, NULL, 10) || _value < 0) {
+        return "Invalid value for OzMaxVMs.";
+    }
+    conf->vm_args.max_vms = static_cast<size_t>(_value);
+    return NULL;
+}
+
+static const char* register_queue_depth(cmd_parms* cmd, void* dummy, const char* value)
+{
+    server_rec* s = cmd->server;
+    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(s->module_config, &wozozo_module));
+    apr_off_t _value;
+    if (apr_strtoff(&_value, value, NULL, 10) || _value < 0) {
+        return "Invalid value for OzQueueDepth.";
+    }
+    conf->vm_args.queue_depth = static_cast<size_t>(_value);
+    return NULL;
+}
+
+static const char* register_queue_timeout(cmd_parms* cmd, void* dummy, const char* value)
+{
+    server_rec* s = cmd->server;
+    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(s->module_config, &wozozo_module));
+    apr_interval_time_t _value;
+    if (ap_timeout_parameter_parse(value, &_value, "ms") != APR_SUCCESS || _value < 0) {
+        return "Invalid value for OzQueueTimeout.";
+    }
+    conf->vm_args.queue_timeout = _value;
+    return NULL;
+}
+
+static const char* register_retry_after(cmd_parms* cmd, void* dummy, const char* value)
+{
+    server_rec* s = cmd->server;
+    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(s->module_config, &wozozo_module));
+    apr_interval_time_t _value;
+    if (ap_timeout_parameter_parse(value, &_value, "s") != APR_SUCCESS || _value < 0) {
+        return "Invalid value for OzRetryAfter.";
+    }
+    conf->vm_args.retry_after = _value;
+    return NULL;
+}
+
+static const char* register_response_cache_size(cmd_parms* cmd, void* dummy, const char* value)
+{
+    server_rec* s = cmd->server;
+    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(s->module_config, &wozozo_module));
+    apr_off_t _value;
+    if (apr_strtoff(&_value, value, NULL, 10) || _value < 0) {
+        return "Invalid value for OzResponseCacheSize.";
+    }
+    conf->vm_args.response_cache_size = static_cast<size_t>(_value);
+    return NULL;
+}
+
+static const char* register_kv_store_size(cmd_parms* cmd, void* dummy, const char* value)
+{
+    server_rec* s = cmd->server;
+    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(s->module_config, &wozozo_module));
+    apr_off_t _value;
+    if (apr_strtoff(&_value, value, NULL, 10) || _value < 0) {
+        return "Invalid value for OzKVStoreSize.";
+    }
+    conf->vm_args.kv_store_size = static_cast<size_t>(_value);
+    return NULL;
+}
+
+static const char* register_file_cache_size(cmd_parms* cmd, void* dummy, const char* value)
+{
+    server_rec* s = cmd->server;
+    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(s->module_config, &wozozo_module));
+    apr_off_t _value;
+    if (apr_strtoff(&_value, value, NULL, 10) || _value < 0) {
+        return "Invalid value for OzFileCacheSize.";
+    }
+    conf->vm_args.file_cache_size = static_cast<size_t>(_value);
+    return NULL;
+}
+
+static const char* register_vm_cpus(cmd_parms* cmd, void* dummy, const char* value)
+{
+    server_rec* s = cmd->server;
+    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(s->module_config, &wozozo_module));
+    std::vector<int> cpus;
+    if (!parse_cpu_list(value, cpus)) {
+        return "Invalid value for OzVMCPUs.";
+    }
+    conf->vm_args.vm_cpus = value;
+    return NULL;
+}
+
+static const char* register_io_cpus(cmd_parms* cmd, void* dummy, const char* value)
+{
+    server_rec* s = cmd->server;
+    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(s->module_config, &wozozo_module));
+    std::vector<int> cpus;
+    if (!parse_cpu_list(value, cpus)) {
+        return "Invalid value for OzIOCPUs.";
+    }
+    conf->vm_args.io_cpus = value;
+    return NULL;
+}
+
+static const char* register_numa(cmd_parms* cmd, void* dummy, int flag)
+{
+    server_rec* s = cmd->server;
+    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(s->module_config, &wozozo_module));
+    conf->vm_args.numa = flag;
+    return NULL;
+}
+
+static const char* register_profile(cmd_parms* cmd, void* dummy, int flag)
+{
+    server_rec* s = cmd->server;
+    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(s->module_config, &wozozo_module));
+    conf->vm_args.profile = flag;
+    return NULL;
+}
+
+static const char* register_profile_rate(cmd_parms* cmd, void* dummy, const char* value)
+{
+    server_rec* s = cmd->server;
+    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(s->module_config, &wozozo_module));
+    apr_off_t _value;
+    if (apr_strtoff(&_value, value, NULL, 10) || _value <= 0 || _value > 10000) {
+        return "Invalid value for OzProfileRate.";
+    }
+    conf->vm_args.profile_rate = static_cast<size_t>(_value);
+    return NULL;
+}
+
+static const char* register_response_cache_max_entry_size(cmd_parms* cmd, void* dummy, const char* value)
+{
+    server_rec* s = cmd->server;
+    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(s->module_config, &wozozo_module));
+    apr_off_t _value;
+    if (apr_strtoff(&_value, value, NULL, 10) || _value <= 0) {
+        return "Invalid value for OzResponseCacheMaxEntrySize.";
+    }
+    conf->vm_args.response_cache_max_entry_size = static_cast<size_t>(_value);
+    return NULL;
+}
+
+// OzUpstream Name Host:Port [max=N] [idle=Time] [check=Time]
+static const char* register_upstream(cmd_parms* cmd, void* dummy, int argc, char* const argv[])
+{
+    server_rec* s = cmd->server;
+    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(s->module_config, &wozozo_module));
+    if (argc < 2) {
+        return "OzUpstream takes a name and a host:port.";
+    }
+    upstream_spec spec;
+    spec.name = argv[0];
+    spec.max_conns = 16;
+    spec.idle_timeout = apr_time_from_sec(60);
+    spec.check_interval = apr_time_from_sec(10);
+
+    char* host;
+    char* scope;
+    apr_port_t port;
+    if (apr_parse_addr_port(&host, &scope, &port, argv[1], cmd->pool) != APR_SUCCESS || !host || !port) {
+        return "Invalid host:port for OzUpstream.";
+    }
+    spec.host = host;
+    spec.port = apr_itoa(cmd->pool, port);
+
+    for (int i = 2; i < argc; ++i) {
+        char const* eq = strchr(argv[i], '=');
+        if (!eq) {
+            return apr_psprintf(cmd->pool, "Invalid OzUpstream option %s.", argv[i]);
+        }
+        std::string key(argv[i], eq - argv[i]);
+        char const* value = eq + 1;
+        apr_off_t n;
+        apr_interval_time_t t;
+        if (key == "max") {
+            if (apr_strtoff(&n, value, NULL, 10) || n < 0) {
+                return "Invalid max for OzUpstream.";
+            }
+            spec.max_conns = static_cast<size_t>(n);
+        } else if (key == "idle") {
+            if (ap_timeout_parameter_parse(value, &t, "ms") != APR_SUCCESS || t < 0) {
+                return "Invalid idle for OzUpstream.";
+            }
+            spec.idle_timeout = t;
+        } else if (key == "check") {
+            if (ap_timeout_parameter_parse(value, &t, "ms") != APR_SUCCESS || t <= 0) {
+                return "Invalid check for OzUpstream.";
+            }
+            spec.check_interval = t;
+        } else {
+            return apr_psprintf(cmd->pool, "Unknown OzUpstream option %s.", argv[i]);
+        }
+    }
+    conf->upstream_specs.push_back(spec);
+    return NULL;
+}
+
+static const char* register_pool_size(cmd_parms* cmd, void* dummy, const char* value)
+{
+    server_rec* s = cmd->server;
+    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(s->module_config, &wozozo_module));
+    apr_off_t _value;
+    if (apr_strtoff(&_value, value, NULL, 10) || _value < 0) {
+        return "Invalid value for OzVMPoolSize.";
+    }
+    conf->vm_args.pool_size = static_cast<size_t>(_value);
+    return NULL;
+}
+
+
+static const char* register_max_requests_per_vm(cmd_parms* cmd, void* dummy, const char* value)
+{
+    server_rec* s = cmd->server;
+    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(s->module_config, &wozozo_module));
+    apr_off_t _value;
+    if (apr_strtoff(&_value, value, NULL, 10) || _value < 0) {
+        return "Invalid value for OzVMMaxRequests.";
+    }
+    conf->vm_args.max_requests_per_vm = static_cast<size_t>(_value);
+    return NULL;
+}
+
+
+static const char* register_read_chunk_size(cmd_parms* cmd, void* dummy, const char* value)
+{
+    server_rec* s = cmd->server;
+    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(s->module_config, &wozozo_module));
+    apr_off_t _value;
+    if (apr_strtoff(&_value, value, NULL, 10) || _value <= 0) {
+        return "Invalid value for OzReadChunkSize.";
+    }
+    conf->vm_args.read_chunk_size = static_cast<size_t>(_value);
+    return NULL;
+}
+
+static const char* register_output_high_water_mark(cmd_parms* cmd, void* dummy, const char* value)
+{
+    server_rec* s = cmd->server;
+    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(s->module_config, &wozozo_module));
+    apr_off_t _value;
+    if (apr_strtoff(&_value, value, NULL, 10) || _value <= 0) {
+        return "Invalid value for OzOutputHighWaterMark.";
+    }
+    conf->vm_args.output_high_water_mark = static_cast<size_t>(_value);
+    return NULL;
+}
+
+
+static command_rec wozozo_commands[] = {
+
+    AP_INIT_TAKE1("OzHome", reinterpret_cast<char const*(*)()>(register_oz_root), NULL, RSRC_CONF,
+                  "Specify Mozart installation directory."),
+
+    AP_INIT_TAKE1("OzSearchPath", reinterpret_cast<char const*(*)()>(register_oz_search_path), NULL, RSRC_CONF,
+                  "Specify the directory for Mozart's search path."),
+
+    AP_INIT_TAKE1("OzSearchLoad", reinterpret_cast<char const*(*)()>(register_oz_search_load), NULL, RSRC_CONF,
+                  "Specify the directory for Mozart's search load path."),
+
+    AP_INIT_TAKE1("OzInitFunctorPath", reinterpret_cast<char const*(*)()>(register_init_functor_path), NULL, RSRC_CONF,
+                  "Specify the path to Init.ozf functor."),
+
+    AP_INIT_TAKE1("OzBaseFunctorPath", reinterpret_cast<char const*(*)()>(register_base_functor_path), NULL, RSRC_CONF,
+                  "Specify the path to Base.ozf functor."),
+
+    AP_INIT_TAKE1("OzBootImage", reinterpret_cast<char const*(*)()>(register_boot_image_path), NULL, RSRC_CONF,
+                  "Specify the path to the boot image VMs are started from."),
+
+    AP_INIT_FLAG("OzFunctorCache", reinterpret_cast<char const*(*)()>(register_functor_cache), NULL, RSRC_CONF,
+                  "Map application functors into memory once and reuse them until they change on disk."),
+
+    AP_INIT_TAKE1("OzMaxMemory", reinterpret_cast<char const*(*)()>(register_max_memory), NULL, RSRC_CONF | ACCESS_CONF,
+                  "Specify the maximum heap size."),
+
+    AP_INIT_TAKE1("OzMinMemory", reinterpret_cast<char const*(*)()>(register_min_memory), NULL, RSRC_CONF | ACCESS_CONF,
+                  "Specify the minimum heap size."),
+
+    AP_INIT_FLAG("OzHeapAutoTune", reinterpret_cast<char const*(*)()>(register_heap_auto_tune), NULL, RSRC_CONF | ACCESS_CONF,
+                  "Size the heap of new VMs after the most each script has been seen to use."),
+
+    AP_INIT_TAKE1("OzFlushMinBytes", reinterpret_cast<char const*(*)()>(register_flush_min_bytes), NULL, RSRC_CONF | ACCESS_CONF,
+                  "Specify the number of bytes that must be written since the last flush for Apache.rflush to flush at once (0 to always flush)."),
+
+    AP_INIT_TAKE1("OzFlushMaxDelay", reinterpret_cast<char const*(*)()>(register_flush_max_delay), NULL, RSRC_CONF | ACCESS_CONF,
+                  "Specify how long a flush held back by OzFlushMinBytes may be delayed, in milliseconds by default."),
+
+    AP_INIT_FLAG("OzFlushEvery", reinterpret_cast<char const*(*)()>(register_flush_every), NULL, RSRC_CONF | ACCESS_CONF,
+                  "Flush the response at every Apache.rflush, regardless of OzFlushMinBytes."),
+
+    AP_INIT_FLAG("OzSuspend", reinterpret_cast<char const*(*)()>(register_suspend), NULL, RSRC_CONF | ACCESS_CONF,
+                  "Let the worker thread go while the VM has no output for it, under an MPM that can resume requests."),
+
+    AP_INIT_TAKE1("OzRequestTimeout", reinterpret_cast<char const*(*)()>(register_request_timeout), NULL, RSRC_CONF | ACCESS_CONF,
+                  "Specify how long a VM may serve a request before it is canceled, in seconds by default (0 for unlimited)."),
+
+    AP_INIT_TAKE1("OzResidentVMs", reinterpret_cast<char const*(*)()>(register_resident_vms), NULL, RSRC_CONF | ACCESS_CONF,
+                  "Specify the number of VMs per child that keep each script loaded and run its requests as Oz threads (0 for a VM per request)."),
+
+    AP_INIT_TAKE1("OzIOThreads", reinterpret_cast<char const*(*)()>(register_io_threads), NULL, RSRC_CONF,
+                  "Specify the number of threads per child that run the Mozart VMs' asynchronous I/O."),
+
+    AP_INIT_TAKE1("OzMaxVMs", reinterpret_cast<char const*(*)()>(register_max_vms), NULL, RSRC_CONF,
+                  "Specify the number of VMs per child that may serve requests at once (0 for the pool size, or unlimited without a pool)."),
+
+    AP_INIT_TAKE1("OzQueueDepth", reinterpret_cast<char const*(*)()>(register_queue_depth), NULL, RSRC_CONF,
+                  "Specify the number of requests that may wait for a VM before others are turned away (0 for unlimited)."),
+
+    AP_INIT_TAKE1("OzQueueTimeout", reinterpret_cast<char const*(*)()>(register_queue_timeout), NULL, RSRC_CONF,
+                  "Specify how long a request may wait for a VM, in milliseconds by default (0 for unlimited)."),
+
+    AP_INIT_TAKE1("OzRetryAfter", reinterpret_cast<char const*(*)()>(register_retry_after), NULL, RSRC_CONF,
+                  "Specify the Retry-After sent with requests turned away, in seconds."),
+
+    AP_INIT_TAKE1("OzVMPoolSize", reinterpret_cast<char const*(*)()>(register_pool_size), NULL, RSRC_CONF,
+                  "Specify the number of pre-booted VMs per child (0 boots a fresh VM per request)."),
+
+    AP_INIT_TAKE1("OzVMMaxRequests", reinterpret_cast<char const*(*)()>(register_max_requests_per_vm), NULL, RSRC_CONF,
+                  "Specify the number of requests a pooled VM serves before being recycled (0 for unlimited)."),
+
+    AP_INIT_TAKE1("OzOutputHighWaterMark", reinterpret_cast<char const*(*)()>(register_output_high_water_mark), NULL, RSRC_CONF,
+                  "Specify the number of output bytes a VM may queue before it is made to wait for the client."),
+
+    AP_INIT_TAKE1("OzReadChunkSize", reinterpret_cast<char const*(*)()>(register_read_chunk_size), NULL, RSRC_CONF,
+                  "Specify the maximum number of bytes Apache.read returns at once."),
+
+    AP_INIT_TAKE1("OzResponseCacheSize", reinterpret_cast<char const*(*)()>(register_response_cache_size), NULL, RSRC_CONF,
+                  "Specify the number of bytes of responses each child may cache (0 to disable the cache)."),
+
+    AP_INIT_TAKE_ARGV("OzUpstream", reinterpret_cast<char const*(*)()>(register_upstream), NULL, RSRC_CONF,
+                  "Define a pool of connections to an upstream server: name, host:port, and optionally max=N, idle=Time and check=Time."),
+
+    AP_INIT_TAKE1("OzResponseCacheMaxEntrySize", reinterpret_cast<char const*(*)()>(register_response_cache_max_entry_size), NULL, RSRC_CONF,
+                  "Specify the largest response body that is cached."),
+
+    AP_INIT_TAKE1("OzKVStoreSize", reinterpret_cast<char const*(*)()>(register_kv_store_size), NULL, RSRC_CONF,
+                  "Specify the number of bytes each child may keep for Apache.kvPut (0 to disable); a single entry may take a sixteenth of it."),
+
+    AP_INIT_TAKE1("OzFileCacheSize", reinterpret_cast<char const*(*)()>(register_file_cache_size), NULL, RSRC_CONF,
+                  "Specify the number of files each child keeps open for Apache.sendFile (0 to open them for each call)."),
+
+    AP_INIT_TAKE1("OzVMCPUs", reinterpret_cast<char const*(*)()>(register_vm_cpus), NULL, RSRC_CONF,
+                  "Specify the CPUs VM threads may run on, as a list such as 0-3,8-11."),
+
+    AP_INIT_TAKE1("OzIOCPUs", reinterpret_cast<char const*(*)()>(register_io_cpus), NULL, RSRC_CONF,
+                  "Specify the CPUs Mozart I/O threads may run on, as a list such as 0-3,8-11."),
+
+    AP_INIT_FLAG("OzNUMA", reinterpret_cast<char const*(*)()>(register_numa), NULL, RSRC_CONF,
+                  "Keep each VM and I/O thread on the CPUs of one NUMA node, so that VM heaps are local to them."),
+
+    AP_INIT_FLAG("OzProfile", reinterpret_cast<char const*(*)()>(register_profile), NULL, RSRC_CONF,
+                  "Sample what the VMs of each child are doing, for the wozozo-profile handler."),
+
+    AP_INIT_TAKE1("OzProfileRate", reinterpret_cast<char const*(*)()>(register_profile_rate), NULL, RSRC_CONF,
+                  "Specify the number of samples OzProfile takes per second."),
+    {NULL}
+};
+
+
+static void *wozozo_create_dir_config(apr_pool_t *p, char *dir)
+{
+    wozozo_dir_conf_t* conf = static_cast<wozozo_dir_conf_t*>(apr_pcalloc(p, sizeof(wozozo_dir_conf_t)));
+    conf->heap_auto_tune = -1;
+    conf->resident_vms = -1;
+    conf->flush_min_bytes = -1;
+    conf->flush_max_delay = -1;
+    conf->flush_every = -1;
+    conf->request_timeout = -1;
+    conf->suspend = -1;
+    return conf;
+}
+
+static void *wozozo_merge_dir_config(apr_pool_t *p, void *_base, void *_add)
+{
+    wozozo_dir_conf_t* base = static_cast<wozozo_dir_conf_t*>(_base);
+    wozozo_dir_conf_t* add = static_cast<wozozo_dir_conf_t*>(_add);
+    wozozo_dir_conf_t* conf = static_cast<wozozo_dir_conf_t*>(apr_pcalloc(p, sizeof(wozozo_dir_conf_t)));
+    conf->min_memory = add->min_memory ? add->min_memory : base->min_memory;
+    conf->max_memory = add->max_memory ? add->max_memory : base->max_memory;
+    conf->heap_auto_tune = add->heap_auto_tune != -1 ? add->heap_auto_tune : base->heap_auto_tune;
+    conf->resident_vms = add->resident_vms != -1 ? add->resident_vms : base->resident_vms;
+    conf->flush_min_bytes = add->flush_min_bytes != -1 ? add->flush_min_bytes : base->flush_min_bytes;
+    conf->flush_max_delay = add->flush_max_delay != -1 ? add->flush_max_delay : base->flush_max_delay;
+    conf->flush_every = add->flush_every != -1 ? add->flush_every : base->flush_every;
+    conf->request_timeout = add->request_timeout != -1 ? add->request_timeout : base->request_timeout;
+    conf->suspend = add->suspend != -1 ? add->suspend : base->suspend;
+    return conf;
+}
+
+static void *wozozo_create_server_config(apr_pool_t *p, server_rec *s)
+{
+    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(apr_pcalloc(p, sizeof(wozozo_server_conf_t)));
+    new (conf) wozozo_server_conf_t(); 
+    return conf;
+}
+
+
+static int wozozo_post_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp, server_rec *s);
+static void wozozo_child_init(apr_pool_t *pool, server_rec *s);
+static int wozozo_handler(request_rec *r);
+static int wozozo_status_handler(request_rec *r);
+static int wozozo_profile_handler(request_rec *r);
+static void wozozo_suspend_connection(conn_rec *c, request_rec *r);
+static void record_request_metrics(request_rec* r, child_stats& stats, request_metrics const& metrics);
+static bool no_cache_requested(request_rec* r);
+static int send_cached_response(request_rec* r, cached_response const& entry);
+static std::shared_ptr<resident_app> resident_app_for(request_rec* r, wozozo_server_conf_t* conf,
+                                                      mozart::VirtualMachineOptions const& options, size_t vms);
+
+static void wozozo_register_hooks(apr_pool_t *p)
+{
+    ap_hook_post_config(wozozo_post_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_child_init(wozozo_child_init, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_handler(wozozo_handler, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_handler(wozozo_status_handler, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_handler(wozozo_profile_handler, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_suspend_connection(wozozo_suspend_connection, NULL, NULL, APR_HOOK_MIDDLE);
+    subrequest_capture_filter = ap_register_output_filter("WOZOZO_SUBREQUEST", wozozo_subrequest_capture_filter, NULL, AP_FTYPE_CONTENT_SET);
+}
+
+AP_DECLARE_MODULE(wozozo) =
+{
+    STANDARD20_MODULE_STUFF,
+    wozozo_create_dir_config,    /* per-directory config creator */
+    wozozo_merge_dir_config,     /* dir config merger */
+    wozozo_create_server_config, /* server config creator */
+    NULL,                        /* server config merger */
+    wozozo_commands,             /* command table */
+    wozozo_register_hooks        /* set up other request processing hooks */
+};
+
+} // extern "C"
+
+static int wozozo_post_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp, server_rec *s)
+{
+    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(s->module_config, &wozozo_module));
+
+    if (conf->vm_args.oz_home) {
+        conf->vm_args.oz_home = ap_resolve_env(pconf, conf->vm_args.oz_home);
+    }
+
+    if (conf->vm_args.init_functor_path) {
+        conf->vm_args.init_functor_path = ap_resolve_env(pconf, conf->vm_args.init_functor_path);
+    }
+
+    if (conf->vm_args.base_functor_path) {
+        conf->vm_args.base_functor_path = ap_resolve_env(pconf, conf->vm_args.base_functor_path);
+    }
+
+    if (conf->vm_args.oz_search_path) {
+        conf->vm_args.oz_search_path = ap_resolve_env(pconf, conf->vm_args.oz_search_path);
+    }
+
+    if (conf->vm_args.oz_search_load) {
+        conf->vm_args.oz_search_load = ap_resolve_env(pconf, conf->vm_args.oz_search_load);
+    }
+
+    if (conf->vm_args.boot_image_path) {
+        conf->vm_args.boot_image_path = ap_resolve_env(pconf, conf->vm_args.boot_image_path);
+    }
+
+    return check_mozart_vm_args(s, conf->vm_args);
+}
+
+static apr_status_t wozozo_child_cleanup(void *_conf)
+{
+    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(_conf);
+    if (conf->pool) {
+        conf->pool->shutdown();
+    }
+    conf->residents.shutdown();
+    for (auto& i: conf->upstreams) {
+        i.second->stop();
+    }
+    if (conf->work) {
+        conf->work.reset();
+    }
+    if (conf->prof) {
+        // VM threads may still be leaving their slots, so the profiler
+        // itself outlives the child
+        conf->prof->stop();
+        conf->prof.release();
+    }
+    for (size_t i = 0; i < conf->io_stats.size(); ++i) {
+        io_thread_stats const& stats = conf->io_stats[i];
+        ap_log_error(APLOG_MARK, APLOG_INFO, 0, conf->server,
+                     "Mozart IO thread #%lu: %lu handlers, %lu wakeups, max queue depth %lu",
+                     static_cast<unsigned long>(i),
+                     static_cast<unsigned long>(stats.handled.load()),
+                     static_cast<unsigned long>(stats.wakeups.load()),
+                     static_cast<unsigned long>(stats.max_depth.load()));
+    }
+    return APR_SUCCESS;
+}
+
+static void wozozo_child_init(apr_pool_t *pool, server_rec *s)
+{
+    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(s->module_config, &wozozo_module));
+    if (conf->vm_args.vm_cpus || conf->vm_args.io_cpus || conf->vm_args.numa) {
+#ifdef __linux__
+        conf->placement = std::make_shared<cpu_placement>(conf->vm_args.numa);
+        if (conf->vm_args.vm_cpus) {
+            parse_cpu_list(conf->vm_args.vm_cpus, conf->placement->vm_cpus);
+        }
+        if (conf->vm_args.io_cpus) {
+            parse_cpu_list(conf->vm_args.io_cpus, conf->placement->io_cpus);
+        }
+        conf->placement->load_nodes();
+#else
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "OzVMCPUs, OzIOCPUs and OzNUMA are only supported on Linux; ignoring them");
+#endif
+    }
+    std::shared_ptr<mozart::boostenv::BoostEnvironment> env(init_mozart_vm_env(s, conf->vm_args, conf->image, conf->stats, conf->placement));
+    conf->env = env;
+    conf->work = std::move(std::unique_ptr<boost::asio::io_service::work>(new boost::asio::io_service::work(env->io_service)));
+    conf->server = s;
+    if (conf->vm_args.profile) {
+        conf->prof = std::move(std::unique_ptr<profiler>(new profiler(conf->vm_args.profile_rate)));
+        conf->prof->start();
+        active_profiler = conf->prof.get();
+    }
+    int async = 0;
+    conf->async_mpm = ap_mpm_query(AP_MPMQ_IS_ASYNC, &async) == APR_SUCCESS && async;
+    // Every VM of the child shares the environment's io_service, so the
+    // threads all run the same one.  Each VM still sees its I/O completions
+    // in order, as they are queued to the VM itself.
+    for (size_t i = 0; i < conf->vm_args.io_threads; ++i) {
+        conf->io_stats.emplace_back();
+        io_thread_stats* stats = &conf->io_stats.back();
+        std::shared_ptr<cpu_placement> placement(conf->placement);
+        conf->io_threads.push_back(std::unique_ptr<boost::thread>(new boost::thread([env, stats, s, i, placement]() {
+            cpu_placement::node* node = placement ? placement->place_io(i) : 0;
+            if (node) {
+                ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, "Mozart IO thread #%lu started on node %d", static_cast<unsigned long>(i), node->id);
+            } else {
+                ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, "Mozart IO thread #%lu started", static_cast<unsigned long>(i));
+            }
+            boost::system::error_code ec;
+            while (env->io_service.run_one(ec)) {
+                uint64_t depth = 1;
+                while (env->io_service.poll_one(ec)) {
+                    ++depth;
+                }
+                stats->record(depth);
+            }
+            ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, "Mozart IO thread #%lu ended", static_cast<unsigned long>(i));
+        })));
+    }
+    if (conf->vm_args.boot_image_path) {
+        prepare_boot_image(pool, s, conf);
+    }
+    for (auto const& spec: conf->upstream_specs) {
+        std::unique_ptr<upstream_pool> pool(new upstream_pool(spec, env->io_service));
+        pool->start();
+        conf->upstreams[spec.name] = std::move(pool);
+    }
+    if (conf->vm_args.response_cache_size > 0) {
+        conf->cache = std::move(std::unique_ptr<response_cache>(new response_cache(conf->vm_args.response_cache_size)));
+    }
+    if (conf->vm_args.kv_store_size > 0) {
+        conf->kv = std::move(std::unique_ptr<kv_store>(new kv_store(conf->vm_args.kv_store_size)));
+    }
+    conf->files = std::move(std::unique_ptr<file_cache>(new file_cache(conf->vm_args.file_cache_size)));
+    // A pool is already a fixed set of VMs; only the queue in front of it
+    // needs bounding
+    size_t max_vms = conf->vm_args.max_vms ? conf->vm_args.max_vms : conf->vm_args.pool_size;
+    if (max_vms > 0) {
+        conf->gate = std::move(std::unique_ptr<admission_gate>(new admission_gate(max_vms, conf->vm_args.queue_depth, conf->vm_args.queue_timeout)));
+    }
+    if (conf->vm_args.pool_size > 0) {
+        mozart::VirtualMachineOptions vmOptions;
+        vmOptions.minimalHeapSize = conf->vm_args.min_memory;
+        vmOptions.maximalHeapSize = conf->vm_args.max_memory;
+        conf->pool = std::move(std::unique_ptr<vm_pool>(new vm_pool(env.get(), vmOptions, conf->vm_args.max_requests_per_vm)));
+        for (size_t i = 0; i < conf->vm_args.pool_size; ++i) {
+            conf->pool->spawn();
+        }
+    }
+    apr_pool_cleanup_register(pool, conf, wozozo_child_cleanup, wozozo_child_cleanup);
+}
+
+struct request_run;
+static int end_request(request_run& run);
+static void resume_request(void* _baton);
+
+// A request from the moment it is handed to a VM until it ends.  Owned by
+// the worker serving it or, once suspended, by the MPM callbacks that
+// resume it.  At most one thread pumps it at a time: the one that finds
+// the output channel parked and unparks it.
+struct request_run {
+    request_rec* r;
+    wozozo_server_conf_t* conf;
+    admission_gate* gate;
+    std::unique_ptr<request_context> ctx;
+    std::unique_ptr<_string> job; // run by a pooled VM
+    std::shared_ptr<request_run> self; // while suspended
+    std::atomic<apr_time_t> timer_due; // of the pending timed callback, if any
+
+    inline request_run(request_rec* r, wozozo_server_conf_t* conf, admission_gate* gate)
+        : r(r), conf(conf), gate(gate), timer_due(0) {}
+
+    inline ~request_run() {
+        if (gate) {
+            gate->leave();
+        }
+    }
+
+    // Runs on whichever worker holds the request: pumps it until the VM
+    // has nothing more for now, then parks it until it does or wake comes,
+    // or ends it.  me is the caller's reference, which keeps the request
+    // alive while another worker may already have taken it over.
+    static void pump(std::shared_ptr<request_run> const& me) {
+        request_run& run = *me;
+        apr_time_t wake;
+        for (;;) {
+            if (run.ctx->pump_once(wake)) {
+                run.self.reset();
+                run.end();
+                return;
+            }
+            if (run.ctx->out.park()) {
+                break;
+            }
+        }
+        apr_time_t due = run.timer_due.load();
+        if (!due || wake < due) {
+            run.timer_due.store(wake);
+            schedule(me, std::max<apr_interval_time_t>(wake - apr_time_now(), 0), wake);
+        }
+    }
+
+    // Has resume_request called after delay.  due is when a timed resume is
+    // for, and 0 for one asked for by the VM, which has unparked already.
+    static void schedule(std::shared_ptr<request_run> const& run, apr_interval_time_t delay, apr_time_t due);
+
+private:
+    inline void end() {
+        request_rec* req = r;
+        int status = end_request(*this);
+        if (status != OK) {
+            req->status = status;
+            ap_send_error_response(req, 0);
+        } else {
+            ap_finalize_request_protocol(req);
+        }
+        ap_process_request_after_handler(req);
+        ap_mpm_resume_suspended(req->connection);
+    }
+};
+
+struct resume_baton {
+    std::shared_ptr<request_run> run;
+    apr_time_t due;
+};
+
+void request_run::schedule(std::shared_ptr<request_run> const& run, apr_interval_time_t delay, apr_time_t due)
+{
+    resume_baton* baton = new resume_baton;
+    baton->run = run;
+    baton->due = due;
+    ap_mpm_register_timed_callback(delay, resume_request, baton);
+}
+
+static void resume_request(void* _baton)
+{
+    std::unique_ptr<resume_baton> baton(static_cast<resume_baton*>(_baton));
+    request_run& run = *baton->run;
+    if (baton->due) {
+        apr_time_t due = baton->due;
+        run.timer_due.compare_exchange_strong(due, 0);
+        if (!run.ctx->out.unpark()) {
+            // Another worker has it, or is about to
+            return;
+        }
+    }
+    request_run::pump(baton->run);
+}
+
+// Called once the worker that suspended a request has let go of it
+static void wozozo_suspend_connection(conn_rec *c, request_rec *r)
+{
+    std::shared_ptr<request_run>* run = static_cast<std::shared_ptr<request_run>*>(ap_get_module_config(c->conn_config, &wozozo_module));
+    if (!run) {
+        return;
+    }
+    ap_set_module_config(c->conn_config, &wozozo_module, NULL);
+    std::shared_ptr<request_run> me(std::move(*run));
+    delete run;
+    request_run::pump(me);
+}
+
+static int wozozo_handler(request_rec *r)
+{
+    int i;
+    wozozo_server_conf_t* server_conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(r->server->module_config, &wozozo_module));
+    if (strcmp(r->handler, "wozozo-handler")) {
+        return DECLINED;
+    }
+
+    if (!r->filename) {
+        return DECLINED;
+    }
+
+    // Locations with heap settings of their own get VMs of their own
+    wozozo_dir_conf_t* dir_conf = static_cast<wozozo_dir_conf_t*>(ap_get_module_config(r->per_dir_config, &wozozo_module));
+    bool auto_tune = dir_conf->heap_auto_tune == 1;
+    bool own_heap = dir_conf->min_memory || dir_conf->max_memory || auto_tune;
+    size_t resident_vms = dir_conf->resident_vms > 0 ? static_cast<size_t>(dir_conf->resident_vms) : 0;
+    mozart::VirtualMachineOptions vmOptions;
+    vmOptions.minimalHeapSize = dir_conf->min_memory ? dir_conf->min_memory : server_conf->vm_args.min_memory;
+    vmOptions.maximalHeapSize = dir_conf->max_memory ? dir_conf->max_memory : server_conf->vm_args.max_memory;
+    if (auto_tune && vmOptions.maximalHeapSize > 2 * mozart::MegaBytes) {
+        size_t peak = server_conf->heap_profiles.peak_of(r->filename);
+        if (peak) {
+            vmOptions.minimalHeapSize = heap_profile::heap_size_for(peak, vmOptions.maximalHeapSize);
+        }
+    }
+    if (!(vmOptions.minimalHeapSize >= 1 * mozart::MegaBytes && vmOptions.minimalHeapSize < vmOptions.maximalHeapSize)) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, APR_EINVAL, r,
+                      "Invalid heap sizes given: min_memory=%zd max_memory=%zd",
+                      vmOptions.minimalHeapSize, vmOptions.maximalHeapSize);
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    child_stats* stats = server_conf->stats.get();
+    ++stats->requests;
+
+    response_cache* cache = server_conf->cache.get();
+    if (cache && r->method_number == M_GET && !no_cache_requested(r)) {
+        std::shared_ptr<cached_response const> entry(cache->lookup(r));
+        if (entry) {
+            ++stats->cache_hits;
+            return send_cached_response(r, *entry);
+        }
+    }
+
+    std::shared_ptr<resident_app> resident;
+    if (resident_vms) {
+        resident = resident_app_for(r, server_conf, vmOptions, resident_vms);
+        if (!resident) {
+            return HTTP_NOT_FOUND;
+        }
+    }
+
+    std::shared_ptr<functor_image> functor;
+    if (server_conf->vm_args.functor_cache && !resident) {
+        functor = server_conf->functors.get(r);
+        if (!functor) {
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    // Resident requests cost an Oz thread rather than a VM
+    admission_gate* gate = resident ? 0 : server_conf->gate.get();
+    if (gate) {
+        apr_interval_time_t waited;
+        bool admitted = gate->enter(waited);
+        stats->queue_wait.record(waited);
+        apr_table_setn(r->notes, "wozozo-queue-wait", apr_psprintf(r->pool, "%" APR_TIME_T_FMT, waited));
+        if (!admitted) {
+            ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r,
+                          "turning away %s: all %lu Mozart VMs are busy",
+                          r->filename, static_cast<unsigned long>(gate->limit));
+            apr_table_setn(r->err_headers_out, "Retry-After",
+                           apr_psprintf(r->pool, "%" APR_TIME_T_FMT, apr_time_sec(server_conf->vm_args.retry_after)));
+            return HTTP_SERVICE_UNAVAILABLE;
+        }
+    }
+    std::shared_ptr<request_run> run(std::make_shared<request_run>(r, server_conf, gate));
+    run->ctx.reset(new request_context(r, server_conf->vm_args));
+    request_context* ctx = run->ctx.get();
+    ctx->flush_every = dir_conf->flush_every == 1;
+    if (dir_conf->flush_min_bytes > 0) {
+        ctx->flush_min_bytes = static_cast<size_t>(dir_conf->flush_min_bytes);
+    }
+    if (dir_conf->flush_max_delay != -1) {
+        ctx->flush_max_delay = dir_conf->flush_max_delay;
+    }
+    if (dir_conf->request_timeout > 0) {
+        ctx->deadline = apr_time_now() + dir_conf->request_timeout;
+    }
+
+    if (resident) {
+        ctx->out.nonblocking_producer = true;
+        if (!resident->dispatch(ctx)) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "no resident Mozart VM is serving %s", r->filename);
+            return HTTP_SERVICE_UNAVAILABLE;
+        }
+    } else if (server_conf->pool && !own_heap) {
+        run->job.reset(new _string(ctx, r->filename));
+        run->job->functor = functor;
+        if (!server_conf->pool->submit(run->job.get())) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "no Mozart VM available to serve %s", r->filename);
+            return HTTP_SERVICE_UNAVAILABLE;
+        }
+    } else {
+        std::unique_ptr<_string> app(new _string(ctx, r->filename));
+        app->functor = functor;
+        if (auto_tune) {
+            app->profile = &server_conf->heap_profiles;
+        }
+        server_conf->env->addVM(1, std::move(std::unique_ptr<std::string>(app.release())), !functor, vmOptions);
+    }
+
+    // Suspended requests are pumped by MPM callbacks from the moment the
+    // worker has let go of the connection
+    if (dir_conf->suspend == 1 && server_conf->async_mpm && !r->main && !r->connection->master && r->connection->cs) {
+        // Called by the VM, which can only unpark the channel while no
+        // worker has the request, so self is still set
+        request_run* suspended = run.get();
+        ctx->out.on_ready = [suspended] () {
+            request_run::schedule(suspended->self, 0, 0);
+        };
+        run->self = run;
+        ap_set_module_config(r->connection->conn_config, &wozozo_module, new std::shared_ptr<request_run>(run));
+        return SUSPENDED;
+    }
+    ctx->pump();
+    return end_request(*run);
+}
+
+// Records what the request cost and, if it may be, caches its response.
+// Returns the status the handler would.
+static int end_request(request_run& run)
+{
+    request_rec* r = run.r;
+    request_context* ctx = run.ctx.get();
+    child_stats* stats = run.conf->stats.get();
+    response_cache* cache = run.conf->cache.get();
+    int status = run.job ? run.job->status : OK;
+
+    record_request_metrics(r, *stats, ctx->metrics);
+    if (ctx->canceled) {
+        apr_table_setn(r->notes, "wozozo-canceled", ctx->canceled);
+        ++stats->canceled;
+    }
+    if (status != OK) {
+        return status;
+    }
+    if (ctx->status != OK) {
+        return ctx->status;
+    }
+    if (cache && ctx->cache_ttl && r->method_number == M_GET && r->status == HTTP_OK
+        && !apr_table_get(r->headers_out, "Set-Cookie")) {
+        cache->store(r, ctx->cache_ttl, ctx->captured);
+    }
+    return OK;
+}
+
+// The resident application serving the request's script, started with vms
+// VMs if there is none yet or the script has changed since.  NULL if the
+// script is not there.
+static std::shared_ptr<resident_app> resident_app_for(request_rec* r, wozozo_server_conf_t* conf,
+                                                      mozart::VirtualMachineOptions const& options, size_t vms)
+{
+    apr_finfo_t finfo = r->finfo;
+    if (finfo.filetype != APR_REG) {
+        if (APR_SUCCESS != apr_stat(&finfo, r->filename, APR_FINFO_MIN, r->pool) || finfo.filetype != APR_REG) {
+            return std::shared_ptr<resident_app>();
+        }
+    }
+    bool created;
+    std::shared_ptr<resident_app> app(conf->residents.get(r->filename, finfo.mtime, vms, created));
+    if (created) {
+        ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "starting %lu resident Mozart VMs for %s",
+                      static_cast<unsigned long>(vms), r->filename);
+        for (size_t i = 0; i < vms; ++i) {
+            conf->env->addVM(1, std::move(std::unique_ptr<std::string>(new _string(app, r->filename))), true, options);
+        }
+    }
+    return app;
+}
+
+static void set_note(request_rec* r, char const* name, uint64_t value)
+{
+    apr_table_setn(r->notes, name, apr_psprintf(r->pool, "%" APR_UINT64_T_FMT, value));
+}
+
+// Makes the metrics of the request available to mod_log_config as
+// %{wozozo-...}n and adds them to the child's aggregates.
+static void record_request_metrics(request_rec* r, child_stats& stats, request_metrics const& metrics)
+{
+    if (metrics.booted) {
+        set_note(r, "wozozo-boot-base", metrics.boot_base);
+        set_note(r, "wozozo-boot-init", metrics.boot_init);
+    }
+    set_note(r, "wozozo-app-load", metrics.app_load);
+    set_note(r, "wozozo-run", metrics.run);
+    set_note(r, "wozozo-heap", metrics.heap);
+    set_note(r, "wozozo-bytes", metrics.bytes_written);
+    set_note(r, "wozozo-flushes", metrics.flushes);
+    set_note(r, "wozozo-flushes-sent", metrics.flushes_sent);
+    stats.record(metrics);
+}
+
+static void print_histogram(request_rec* r, char const* name, latency_histogram const& histogram)
+{
+    ap_rprintf(r, "%sTotal: %" APR_UINT64_T_FMT "\n", name, histogram.total.load());
+    ap_rprintf(r, "%sHistogram:", name);
+    apr_interval_time_t bound = 1;
+    for (size_t i = 0; i < latency_histogram::buckets; ++i, bound *= 2) {
+        ap_rprintf(r, " <=%" APR_TIME_T_FMT "ms:%" APR_UINT64_T_FMT, bound, histogram.counts[i].load());
+    }
+    ap_rprintf(r, " more:%" APR_UINT64_T_FMT "\n", histogram.counts[latency_histogram::buckets].load());
+}
+
+// Reports the aggregates of the child that happens to serve the request,
+// in the style of mod_status' ?auto output.
+static int wozozo_status_handler(request_rec *r)
+{
+    if (strcmp(r->handler, "wozozo-status")) {
+        return DECLINED;
+    }
+
+    wozozo_server_conf_t* server_conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(r->server->module_config, &wozozo_module));
+    child_stats const& stats = *server_conf->stats;
+    ap_set_content_type(r, "text/plain; charset=ISO-8859-1");
+    if (r->header_only) {
+        return OK;
+    }
+
+    ap_rprintf(r, "Pid: %" APR_PID_T_FMT "\n", getpid());
+    ap_rprintf(r, "Requests: %" APR_UINT64_T_FMT "\n", stats.requests.load());
+    ap_rprintf(r, "CacheHits: %" APR_UINT64_T_FMT "\n", stats.cache_hits.load());
+    ap_rprintf(r, "ActiveVMs: %ld\n", stats.active_vms.load());
+    if (server_conf->gate) {
+        admission_gate& gate = *server_conf->gate;
+        boost::lock_guard<boost::mutex> lock(gate.mtx);
+        ap_rprintf(r, "QueuedRequests: %lu\n", static_cast<unsigned long>(gate.waiting));
+        ap_rprintf(r, "Rejected: %" APR_UINT64_T_FMT "\n", gate.rejected.load());
+        ap_rprintf(r, "TimedOut: %" APR_UINT64_T_FMT "\n", gate.timed_out.load());
+    }
+    if (server_conf->pool) {
+        vm_pool& pool = *server_conf->pool;
+        boost::lock_guard<boost::mutex> lock(pool.mtx);
+        ap_rprintf(r, "PooledVMs: %lu\n", static_cast<unsigned long>(pool.live));
+        ap_rprintf(r, "PoolQueue: %lu\n", static_cast<unsigned long>(pool.jobs.size()));
+    }
+    ap_rprintf(r, "ResidentVMs: %lu\n", static_cast<unsigned long>(server_conf->residents.ready_vms()));
+    if (server_conf->kv) {
+        kv_store& kv = *server_conf->kv;
+        std::pair<size_t, size_t> usage = kv.usage();
+        ap_rprintf(r, "KVEntries: %lu\n", static_cast<unsigned long>(usage.first));
+        ap_rprintf(r, "KVBytes: %lu\n", static_cast<unsigned long>(usage.second));
+        ap_rprintf(r, "KVHits: %" APR_UINT64_T_FMT "\n", kv.hits.load());
+        ap_rprintf(r, "KVMisses: %" APR_UINT64_T_FMT "\n", kv.misses.load());
+        ap_rprintf(r, "KVEvictions: %" APR_UINT64_T_FMT "\n", kv.evictions.load());
+    }
+    if (server_conf->files) {
+        ap_rprintf(r, "OpenFiles: %lu\n", static_cast<unsigned long>(server_conf->files->size()));
+        ap_rprintf(r, "FileOpens: %" APR_UINT64_T_FMT "\n", server_conf->files->opens.load());
+    }
+    for (auto const& i: server_conf->upstreams) {
+        upstream_pool& pool = *i.second;
+        boost::lock_guard<boost::mutex> lock(pool.mtx);
+        ap_rprintf(r, "Upstream%s: open=%lu idle=%lu waiting=%lu connects=%" APR_UINT64_T_FMT
+                      " reuses=%" APR_UINT64_T_FMT " failures=%" APR_UINT64_T_FMT " dropped=%" APR_UINT64_T_FMT "\n",
+                   pool.spec.name.c_str(), static_cast<unsigned long>(pool.open),
+                   static_cast<unsigned long>(pool.idle.size()), static_cast<unsigned long>(pool.waiters.size()),
+                   pool.connects.load(), pool.reuses.load(), pool.failures.load(), pool.dropped.load());
+    }
+    ap_rprintf(r, "BytesWritten: %" APR_UINT64_T_FMT "\n", stats.bytes_written.load());
+    ap_rprintf(r, "Flushes: %" APR_UINT64_T_FMT "\n", stats.flushes.load());
+    ap_rprintf(r, "FlushesSent: %" APR_UINT64_T_FMT "\n", stats.flushes_sent.load());
+    ap_rprintf(r, "Canceled: %" APR_UINT64_T_FMT "\n", stats.canceled.load());
+    ap_rprintf(r, "PeakHeap: %lu\n", static_cast<unsigned long>(stats.peak_heap.load()));
+    for (size_t i = 0; i < server_conf->io_stats.size(); ++i) {
+        io_thread_stats const& io = server_conf->io_stats[i];
+        ap_rprintf(r, "IOThread%lu: handled=%" APR_UINT64_T_FMT " wakeups=%" APR_UINT64_T_FMT
+                      " depth=%" APR_UINT64_T_FMT " maxdepth=%" APR_UINT64_T_FMT "\n",
+                   static_cast<unsigned long>(i), io.handled.load(), io.wakeups.load(),
+                   io.last_depth.load(), io.max_depth.load());
+    }
+    print_histogram(r, "QueueWait", stats.queue_wait);
+    print_histogram(r, "Boot", stats.boot);
+    print_histogram(r, "AppLoad", stats.app_load);
+    print_histogram(r, "Run", stats.run);
+    if (server_conf->placement && server_conf->placement->numa) {
+        for (auto const& node: server_conf->placement->nodes) {
+            uint64_t numastat[4];
+            cpu_placement::read_numastat(node.id, numastat);
+            ap_rprintf(r, "Node%d: cpus=%lu vms=%" APR_UINT64_T_FMT " requests=%" APR_UINT64_T_FMT
+                          " numa_hit=%" APR_UINT64_T_FMT " numa_miss=%" APR_UINT64_T_FMT
+                          " local_node=%" APR_UINT64_T_FMT " other_node=%" APR_UINT64_T_FMT "\n",
+                       node.id, static_cast<unsigned long>(node.cpus.size()), node.vms.load(), node.requests.load(),
+                       numastat[0], numastat[1], numastat[2], numastat[3]);
+        }
+    }
+    if (server_conf->prof) {
+        profiler& prof = *server_conf->prof;
+        for (size_t i = 0; i < profiler::builtin_count; ++i) {
+            profiler::builtin_stats const& b = prof.builtins[i];
+            ap_rprintf(r, "%s: calls=%" APR_UINT64_T_FMT " total_us=%" APR_UINT64_T_FMT " max_us=%" APR_UINT64_T_FMT "\n",
+                       profiler::builtin_name(static_cast<profiler::builtin_id>(i)),
+                       b.calls.load(), b.total.load(), b.max.load());
+        }
+    }
+    return OK;
+}
+
+// Reports the samples OzProfile took in the child that happens to serve
+// the request, one folded stack per line; ?reset starts afresh
+static int wozozo_profile_handler(request_rec *r)
+{
+    if (strcmp(r->handler, "wozozo-profile")) {
+        return DECLINED;
+    }
+
+    wozozo_server_conf_t* server_conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(r->server->module_config, &wozozo_module));
+    if (!server_conf->prof) {
+        return HTTP_NOT_FOUND;
+    }
+    ap_set_content_type(r, "text/plain; charset=ISO-8859-1");
+    if (r->header_only) {
+        return OK;
+    }
+    server_conf->prof->dump(r, r->args && !strcmp(r->args, "reset"));
+    return OK;
+}
+
+static bool no_cache_requested(request_rec* r)
+{
+    char const* cache_control = apr_table_get(r->headers_in, "Cache-Control");
+    char const* pragma = apr_table_get(r->headers_in, "Pragma");
+    return (cache_control && ap_strcasestr(cache_control, "no-cache"))
+        || (pragma && ap_strcasestr(pragma, "no-cache"));
+}
+
+// Answers a request from the cache, the way the default handler answers
+// it from a file.
+static int send_cached_response(request_rec* r, cached_response const& entry)
+{
+    for (auto const& header: entry.headers) {
+        apr_table_add(r->headers_out, header.first.c_str(), header.second.c_str());
+    }
+    if (!entry.content_type.empty()) {
+        ap_set_content_type(r, apr_pstrmemdup(r->pool, entry.content_type.data(), entry.content_type.size()));
+    }
+    apr_table_setn(r->headers_out, "Age",
+                   apr_psprintf(r->pool, "%" APR_TIME_T_FMT, apr_time_sec(apr_time_now() - entry.stored)));
+    ap_update_mtime(r, entry.mtime);
+    apr_table_setn(r->notes, "wozozo-cache", "hit");
+
+    int status = ap_meets_conditions(r);
+    if (status != OK) {
+        return status;
+    }
+    ap_set_content_length(r, entry.body.size());
+    if (r->header_only) {
+        return OK;
+    }
+
+    apr_bucket_brigade* bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+    // Transient, so that whatever outlives this call is copied out of the entry
+    APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_transient_create(entry.body.data(), entry.body.size(), bb->bucket_alloc));
+    APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_eos_create(bb->bucket_alloc));
+    apr_status_t rv = ap_pass_brigade(r->output_filters, bb);
+    if (rv != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_INFO, rv, r, "could not write cached response");
+    }
+    return OK;
+}
+
+
+static int check_mozart_vm_args(server_rec *s, mozart_vm_args_t const& args)
+{
+    if (!args.oz_home) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "OzHome must be specified");
+        return DECLINED;
+    }
+
+    if (!(args.min_memory >= 1 * mozart::MegaBytes && args.min_memory < args.max_memory)) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, APR_EINVAL, s,
+                     "Invalid heap sizes given: min_memory=%zd max_memory=%zd",
+                     args.min_memory, args.max_memory);
+        return DECLINED;
+    }
+
+    return OK;
+}
+
+// Walks a virtual string depth first with an explicit stack, so that deeply
+// nested # trees cannot exhaust the C stack, and hands every piece to
+// sink in a single pass.  Raises a type error if vs is not a virtual
+// string, and suspends the calling thread on any unbound variable in it;
+// callers that write to a shared sink must be prepared to roll back.
+template <typename Sink>
+static void ozVSWalk(mozart::VM vm, mozart::RichNode vs, Sink& sink)
+{
+    using namespace mozart::patternmatching;
+
+    std::vector<mozart::RichNode> stack;
+    stack.push_back(vs);
+
+    while (!stack.empty()) {
+        mozart::RichNode n = stack.back();
+        stack.pop_back();
+
+        size_t partCount;
+        mozart::StaticArray<mozart::StableNode> parts;
+
+        mozart::atom_t atomValue;
+        mozart::nativeint intValue;
+        double floatValue;
+
+        if (n.isTransient()) {
+            mozart::waitFor(vm, n);
+        } else if (matchesVariadicSharp(vm, n, partCount, parts)) {
+            for (size_t i = partCount; i > 0; --i) {
+                stack.push_back(parts[i - 1]);
+            }
+        } else if (matches(vm, n, capture(atomValue))) {
+            if (atomValue != vm->coreatoms.nil) {
+                sink.write(atomValue.contents(), atomValue.length());
+            }
+        } else if (n.is<mozart::Cons>()) {
+            // A string: the head must be a character, and the tail is
+            // walked as the rest of the virtual string
+            auto cons = n.as<mozart::Cons>();
+            mozart::RichNode head(*cons.getHead());
+            if (head.isTransient()) {
+                mozart::waitFor(vm, head);
+            }
+            if (!matches(vm, head, capture(intValue)) || intValue < 0 || intValue > 0x10FFFF) {
+                mozart::raiseTypeError(vm, "VirtualString", vs);
+            }
+            char* p = sink.reserve(4);
+            sink.commit(mozart::toUTF(static_cast<char32_t>(intValue), p));
+            stack.push_back(*cons.getTail());
+        } else if (n.is<mozart::String>()) {
+            auto& value = n.as<mozart::String>().value();
+            sink.write(value.string, value.length);
+        } else if (n.is<mozart::ByteString>()) {
+            auto& value = n.as<mozart::ByteString>().value();
+            sink.write(reinterpret_cast<char const*>(value.string), value.length);
+        } else if (matches(vm, n, capture(intValue))) {
+            mozart::internal::IntToStrBuffer buffer;
+            auto length = mozart::internal::intToStrBuffer(buffer, intValue);
+            sink.write(buffer, length);
+        } else if (n.is<mozart::BigInt>()) {
+            std::string buffer = n.as<mozart::BigInt>().str();
+            sink.write(buffer.data(), buffer.size());
+        } else if (matches(vm, n, capture(floatValue))) {
+            mozart::internal::FloatToStrBuffer buffer;
+            auto length = mozart::internal::floatToStrBuffer(buffer, floatValue);
+            sink.write(buffer, length);
+        } else {
+            mozart::raiseTypeError(vm, "VirtualString", vs);
+        }
+    }
+}
+
+struct string_sink {
+    std::string& out;
+
+    inline string_sink(std::string& out): out(out) {}
+
+    inline void write(char const* p, size_t n) {
+        out.append(p, n);
+    }
+
+    inline char* reserve(size_t n) {
+        size_t len = out.size();
+        out.resize(len + n);
+        reserved = len;
+        return &out[len];
+    }
+
+    inline void commit(size_t n) {
+        out.resize(reserved + n);
+    }
+
+    size_t reserved;
+};
+
+static void ozVSGet(mozart::VM vm, mozart::RichNode n, std::string& out)
+{
+    string_sink sink(out);
+    ozVSWalk(vm, n, sink);
+}
+
+// Runs write, which writes to the output channel, so that either all it
+// writes is queued or, if it raises or suspends, none of it.
+template <typename F>
+static void ozWriteAtomically(output_channel& out, F write)
+{
+    out.mark();
+    try {
+        write();
+    } catch (...) {
+        out.rollback();
+        throw;
+    }
+    out.release();
+}
+
+// Encodes the virtual string straight into the output channel's chunks.
+static void ozVSWrite(mozart::VM vm, mozart::RichNode n, output_channel& out)
+{
+    ozWriteAtomically(out, [&] () {
+        ozVSWalk(vm, n, out);
+    });
+}
+
+// Vector scanning for the escaping sinks below: whichever of AVX2 and SSE2
+// the module is compiled for, or a byte at a time without either
+#if defined(__AVX2__)
+struct simd {
+    typedef __m256i vec;
+    static const size_t width = 32;
+
+    static inline vec load(char const* p) { return _mm256_loadu_si256(reinterpret_cast<vec const*>(p)); }
+    static inline vec splat(unsigned char c) { return _mm256_set1_epi8(static_cast<char>(c)); }
+    static inline vec any(vec a, vec b) { return _mm256_or_si256(a, b); }
+    static inline vec eq(vec v, unsigned char c) { return _mm256_cmpeq_epi8(v, splat(c)); }
+    // Unsigned v <= c
+    static inline vec le(vec v, unsigned char c) { return _mm256_cmpeq_epi8(_mm256_min_epu8(v, splat(c)), v); }
+    static inline vec in(vec v, unsigned char lo, unsigned char hi) { return le(_mm256_sub_epi8(v, splat(lo)), hi - lo); }
+    static inline uint32_t mask(vec v) { return static_cast<uint32_t>(_mm256_movemask_epi8(v)); }
+};
+#elif defined(__SSE2__)
+struct simd {
+    typedef __m128i vec;
+    static const size_t width = 16;
+
+    static inline vec load(char const* p) { return _mm_loadu_si128(reinterpret_cast<vec const*>(p)); }
+    static inline vec splat(unsigned char c) { return _mm_set1_epi8(static_cast<char>(c)); }
+    static inline vec any(vec a, vec b) { return _mm_or_si128(a, b); }
+    static inline vec eq(vec v, unsigned char c) { return _mm_cmpeq_epi8(v, splat(c)); }
+    // Unsigned v <= c
+    static inline vec le(vec v, unsigned char c) { return _mm_cmpeq_epi8(_mm_min_epu8(v, splat(c)), v); }
+    static inline vec in(vec v, unsigned char lo, unsigned char hi) { return le(_mm_sub_epi8(v, splat(lo)), hi - lo); }
+    static inline uint32_t mask(vec v) { return static_cast<uint32_t>(_mm_movemask_epi8(v)); }
+};
+#endif
+
+static char const hex_digits[] = "0123456789ABCDEF";
+
+// &, <, >, " and ' as HTML character references
+struct html_escaper {
+    static const size_t max_escaped = 6;
+
+    static inline bool special(unsigned char c) {
+        return c == '&' || c == '<' || c == '>' || c == '"' || c == '\'';
+    }
+
+#ifdef WOZOZO_SIMD
+    static inline simd::vec special(simd::vec v) {
+        return simd::any(simd::any(simd::eq(v, '&'), simd::eq(v, '<')),
+                         simd::any(simd::any(simd::eq(v, '>'), simd::eq(v, '"')), simd::eq(v, '\'')));
+    }
+#endif
+
+    static inline size_t escape(unsigned char c, char* out) {
+        char const* ref;
+        switch (c) {
+        case '&': ref = "&amp;"; break;
+        case '<': ref = "&lt;"; break;
+        case '>': ref = "&gt;"; break;
+        case '"': ref = "&quot;"; break;
+        default: ref = "&#39;"; break;
+        }
+        size_t n = strlen(ref);
+        std::copy_n(ref, n, out);
+        return n;
+    }
+};
+
+// Percent-encodes everything but the unreserved characters of RFC 3986
+struct url_encoder {
+    static const size_t max_escaped = 3;
+
+    static inline bool special(unsigned char c) {
+        return !(apr_isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~');
+    }
+
+#ifdef WOZOZO_SIMD
+    static inline simd::vec special(simd::vec v) {
+        simd::vec plain = simd::any(simd::any(simd::in(v, 'a', 'z'), simd::in(v, 'A', 'Z')),
+                                    simd::any(simd::in(v, '0', '9'), simd::eq(v, '~')));
+        plain = simd::any(plain, simd::any(simd::in(v, '-', '.'), simd::eq(v, '_')));
+        return simd::eq(plain, 0);
+    }
+#endif
+
+    static inline size_t escape(unsigned char c, char* out) {
+        out[0] = '%';
+        out[1] = hex_digits[c >> 4];
+        out[2] = hex_digits[c & 15];
+        return 3;
+    }
+};
+
+// The inside of a JSON string.  Anything but quotes, backslashes and
+// control characters, UTF-8 included, is left as it is.
+struct json_escaper {
+    static const size_t max_escaped = 6;
+
+    static inline bool special(unsigned char c) {
+        return c < 0x20 || c == '"' || c == '\\';
+    }
+
+#ifdef WOZOZO_SIMD
+    static inline simd::vec special(simd::vec v) {
+        return simd::any(simd::le(v, 0x1f), simd::any(simd::eq(v, '"'), simd::eq(v, '\\')));
+    }
+#endif
+
+    static inline size_t escape(unsigned char c, char* out) {
+        out[0] = '\\';
+        switch (c) {
+        case '"': out[1] = '"'; return 2;
+        case '\\': out[1] = '\\'; return 2;
+        case '\n': out[1] = 'n'; return 2;
+        case '\r': out[1] = 'r'; return 2;
+        case '\t': out[1] = 't'; return 2;
+        case '\b': out[1] = 'b'; return 2;
+        case '\f': out[1] = 'f'; return 2;
+        }
+        std::copy_n("u00", 3, out + 1);
+        out[4] = hex_digits[c >> 4];
+        out[5] = hex_digits[c & 15];
+        return 6;
+    }
+};
+
+// Length of the run at p that Escaper leaves as it is
+template <typename Escaper>
+static size_t plain_run(char const* p, size_t n)
+{
+    size_t i = 0;
+#ifdef WOZOZO_SIMD
+    for (; i + simd::width <= n; i += simd::width) {
+        uint32_t m = simd::mask(Escaper::special(simd::load(p + i)));
+        if (m) {
+            return i + __builtin_ctz(m);
+        }
+    }
+#endif
+    while (i < n && !Escaper::special(static_cast<unsigned char>(p[i]))) {
+        ++i;
+    }
+    return i;
+}
+
+// A sink for ozVSWalk that escapes what it is given on its way to the
+// output channel, copying plain runs in one go
+template <typename Escaper>
+struct escaping_sink {
+    output_channel& out;
+    char scratch[4];
+
+    inline escaping_sink(output_channel& out): out(out) {}
+
+    inline void write(char const* p, size_t n) {
+        while (n > 0) {
+            size_t plain = plain_run<Escaper>(p, n);
+            out.write(p, plain);
+            if (plain == n) {
+                break;
+            }
+            out.commit(Escaper::escape(static_cast<unsigned char>(p[plain]), out.reserve(Escaper::max_escaped)));
+            p += plain + 1;
+            n -= plain + 1;
+        }
+    }
+
+    // Characters of Oz strings are encoded into scratch, then escaped
+    inline char* reserve(size_t n) {
+        return scratch;
+    }
+
+    inline void commit(size_t n) {
+        write(scratch, n);
+    }
+};
+
+// A sink for ozVSWalk that Base64-encodes what it is given.  finish()
+// writes out the last, padded, group.
+struct base64_sink {
+    output_channel& out;
+    unsigned char pending[3];
+    size_t pending_len;
+    char scratch[4];
+
+    static char const* alphabet() {
+        return "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    }
+
+    inline base64_sink(output_channel& out): out(out), pending_len(0) {}
+
+    inline void write(char const* _p, size_t n) {
+        unsigned char const* p = reinterpret_cast<unsigned char const*>(_p);
+        while (pending_len > 0 && pending_len < 3 && n > 0) {
+            pending[pending_len++] = *p++;
+            --n;
+        }
+        if (pending_len == 3) {
+            encode(pending, out.reserve(4));
+            out.commit(4);
+            pending_len = 0;
+        }
+        while (n >= 3) {
+            // A chunk's worth of groups at a time
+            size_t groups = std::min(n / 3, output_channel::chunk_size / 4);
+            char* q = out.reserve(groups * 4);
+            for (size_t i = 0; i < groups; ++i, p += 3, q += 4) {
+                encode(p, q);
+            }
+            out.commit(groups * 4);
+            n -= groups * 3;
+        }
+        while (n > 0) {
+            pending[pending_len++] = *p++;
+            --n;
+        }
+    }
+
+    inline char* reserve(size_t n) {
+        return scratch;
+    }
+
+    inline void commit(size_t n) {
+        write(scratch, n);
+    }
+
+    inline void finish() {
+        if (pending_len == 0) {
+            return;
+        }
+        char* q = out.reserve(4);
+        q[0] = alphabet()[pending[0] >> 2];
+        if (pending_len == 1) {
+            q[1] = alphabet()[(pending[0] & 3) << 4];
+            q[2] = '=';
+        } else {
+            q[1] = alphabet()[((pending[0] & 3) << 4) | (pending[1] >> 4)];
+            q[2] = alphabet()[(pending[1] & 15) << 2];
+        }
+        q[3] = '=';
+        out.commit(4);
+        pending_len = 0;
+    }
+
+private:
+    static inline void encode(unsigned char const* p, char* q) {
+        q[0] = alphabet()[p[0] >> 2];
+        q[1] = alphabet()[((p[0] & 3) << 4) | (p[1] >> 4)];
+        q[2] = alphabet()[((p[1] & 15) << 2) | (p[2] >> 6)];
+        q[3] = alphabet()[p[2] & 63];
+    }
+};
+
+// Writes an Oz value as JSON, depth first with an explicit stack like
+// ozVSWalk.  true, false, unit and null map to themselves, numbers to
+// numbers, lists to arrays and other records to objects keyed by their
+// features.  Virtual strings that are not lists (atoms, compact strings,
+// ByteStrings and # tuples) become strings, so text built as a list of
+// characters has to be wrapped in a # tuple or it is written as an array.
+static void ozJsonWalk(mozart::VM vm, mozart::RichNode value, output_channel& out)
+{
+    using namespace mozart::patternmatching;
+
+    // A value, a feature to write as a key (a node, or the index of a
+    // tuple element), or punctuation
+    struct item {
+        enum kind_t { VALUE, KEY, INDEX, LITERAL } kind;
+        mozart::RichNode node;
+        size_t index;
+        char const* literal;
+    };
+    std::vector<item> stack;
+    auto push = [&stack] (item::kind_t kind, mozart::RichNode node, size_t index, char const* literal) {
+        item i = { kind, node, index, literal };
+        stack.push_back(i);
+    };
+    push(item::VALUE, value, 0, 0);
+    escaping_sink<json_escaper> sink(out);
+
+    while (!stack.empty()) {
+        item i = stack.back();
+        stack.pop_back();
+        mozart::RichNode n = i.node;
+
+        size_t partCount;
+        mozart::StaticArray<mozart::StableNode> parts;
+
+        mozart::atom_t atomValue;
+        bool boolValue;
+
+        if (i.kind == item::LITERAL) {
+            out.write(i.literal, strlen(i.literal));
+            continue;
+        } else if (i.kind == item::INDEX) {
+            char buffer[32];
+            out.write(buffer, apr_snprintf(buffer, sizeof(buffer), "\"%" APR_SIZE_T_FMT "\":", i.index));
+            continue;
+        }
+
+        if (n.isTransient()) {
+            mozart::waitFor(vm, n);
+        }
+        if (i.kind == item::KEY) {
+            // Names have no JSON counterpart
+            if (!n.is<mozart::Atom>() && !n.is<mozart::SmallInt>() && !n.is<mozart::BigInt>()) {
+                mozart::raiseTypeError(vm, "Atom or Int", n);
+            }
+            out.write("\"", 1);
+            ozVSWalk(vm, n, sink);
+            out.write("\":", 2);
+        } else if (matches(vm, n, capture(boolValue))) {
+            out.write(boolValue ? "true" : "false", boolValue ? 4 : 5);
+        } else if (n.is<mozart::Unit>()) {
+            out.write("null", 4);
+        } else if (n.is<mozart::Cons>() || matches(vm, n, vm->coreatoms.nil)) {
+            std::vector<mozart::RichNode> elements;
+            ozForEachListItem(vm, n, [&elements] (mozart::RichNode e) {
+                elements.push_back(e);
+            });
+            push(item::LITERAL, n, 0, "]");
+            for (size_t j = elements.size(); j > 0; --j) {
+                push(item::VALUE, elements[j - 1], 0, 0);
+                if (j > 1) {
+                    push(item::LITERAL, n, 0, ",");
+                }
+            }
+            push(item::LITERAL, n, 0, "[");
+        } else if (matches(vm, n, capture(atomValue))) {
+            if (atomValue.length() == 4 && memcmp(atomValue.contents(), "null", 4) == 0) {
+                out.write("null", 4);
+            } else {
+                out.write("\"", 1);
+                sink.write(atomValue.contents(), atomValue.length());
+                out.write("\"", 1);
+            }
+        } else if (n.is<mozart::SmallInt>() || n.is<mozart::BigInt>() || n.is<mozart::Float>()) {
+            // Oz writes negative numbers with ~
+            std::string number;
+            ozVSGet(vm, n, number);
+            std::replace(number.begin(), number.end(), '~', '-');
+            out.write(number.data(), number.size());
+        } else if (n.is<mozart::String>() || n.is<mozart::ByteString>() ||
+                   matchesVariadicSharp(vm, n, partCount, parts)) {
+            out.write("\"", 1);
+            ozVSWalk(vm, n, sink);
+            out.write("\"", 1);
+        } else if (n.is<mozart::Tuple>()) {
+            auto tuple = n.as<mozart::Tuple>();
+            push(item::LITERAL, n, 0, "}");
+            for (size_t j = tuple.getWidth(); j > 0; --j) {
+                push(item::VALUE, *tuple.getElement(j - 1), 0, 0);
+                push(item::INDEX, n, j, 0);
+                if (j > 1) {
+                    push(item::LITERAL, n, 0, ",");
+                }
+            }
+            push(item::LITERAL, n, 0, "{");
+        } else if (n.is<mozart::Record>()) {
+            auto record = n.as<mozart::Record>();
+            auto arity = mozart::RichNode(*record.getArity()).as<mozart::Arity>();
+            push(item::LITERAL, n, 0, "}");
+            for (size_t j = record.getWidth(); j > 0; --j) {
+                push(item::VALUE, *record.getElement(j - 1), 0, 0);
+                push(item::KEY, *arity.getElement(j - 1), 0, 0);
+                if (j > 1) {
+                    push(item::LITERAL, n, 0, ",");
+                }
+            }
+            push(item::LITERAL, n, 0, "{");
+        } else {
+            mozart::raiseTypeError(vm, "JSON value", value);
+        }
+    }
+}
+
+
+// Static text shorter than this is copied into the response rather than
+// sent from the template, where a bucket of its own would cost more
+static const size_t template_share_min = 256;
+
+// Looks a template name up in n: n itself for ".", otherwise the field
+// of the record n with that atom as its feature, if n has one
+static bool ozTemplateLookup(mozart::VM vm, mozart::RichNode n, char const* name, size_t len, mozart::RichNode& value)
+{
+    using namespace mozart::patternmatching;
+    if (len == 1 && *name == '.') {
+        value = n;
+        return true;
+    }
+    if (n.isTransient()) {
+        mozart::waitFor(vm, n);
+    }
+    if (!n.is<mozart::Record>()) {
+        return false;
+    }
+    auto record = n.as<mozart::Record>();
+    auto arity = mozart::RichNode(*record.getArity()).as<mozart::Arity>();
+    for (size_t i = 0; i < record.getWidth(); ++i) {
+        mozart::atom_t atomValue;
+        if (matches(vm, *arity.getElement(i), capture(atomValue)) &&
+            atomValue.length() == len && memcmp(atomValue.contents(), name, len) == 0) {
+            value = *record.getElement(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Runs the instructions of tmpl from begin up to end, looking names up
+// in scopes from the innermost out
+static void ozTemplateRender(mozart::VM vm, std::shared_ptr<compiled_template const> const& tmpl,
+                             size_t begin, size_t end, std::vector<mozart::RichNode>& scopes, output_channel& out)
+{
+    using namespace mozart::patternmatching;
+    typedef compiled_template::instr instr;
+
+    for (size_t pc = begin; pc < end; ++pc) {
+        instr const& i = tmpl->code[pc];
+        if (i.kind == instr::TEXT) {
+            if (i.len >= template_share_min) {
+                out.write_shared(tmpl->at(i), i.len, tmpl);
+            } else {
+                out.write(tmpl->at(i), i.len);
+            }
+            continue;
+        }
+
+        mozart::RichNode value;
+        bool found = false;
+        for (size_t j = scopes.size(); j > 0 && !found; --j) {
+            found = ozTemplateLookup(vm, scopes[j - 1], tmpl->at(i), i.len, value);
+        }
+        if (found && value.isTransient()) {
+            mozart::waitFor(vm, value);
+        }
+
+        bool boolValue;
+        switch (i.kind) {
+        case instr::FIELD:
+            if (found) {
+                escaping_sink<html_escaper> sink(out);
+                ozVSWalk(vm, value, sink);
+            }
+            break;
+        case instr::RAW:
+            if (found) {
+                ozVSWalk(vm, value, out);
+            }
+            break;
+        case instr::SECTION:
+        case instr::INVERTED: {
+            bool empty = !found || value.is<mozart::Unit>() || matches(vm, value, vm->coreatoms.nil) ||
+                         (matches(vm, value, capture(boolValue)) && !boolValue);
+            if (i.kind == instr::INVERTED) {
+                if (empty) {
+                    ozTemplateRender(vm, tmpl, pc + 1, i.end, scopes, out);
+                }
+            } else if (empty) {
+                // Skipped
+            } else if (value.is<mozart::Cons>()) {
+                ozForEachListItem(vm, value, [&] (mozart::RichNode element) {
+                    scopes.push_back(element);
+                    ozTemplateRender(vm, tmpl, pc + 1, i.end, scopes, out);
+                    scopes.pop_back();
+                });
+            } else if (matches(vm, value, capture(boolValue))) {
+                ozTemplateRender(vm, tmpl, pc + 1, i.end, scopes, out);
+            } else {
+                scopes.push_back(value);
+                ozTemplateRender(vm, tmpl, pc + 1, i.end, scopes, out);
+                scopes.pop_back();
+            }
+            pc = i.end;
+            break;
+        }
+        default:
+            break;
+        }
+    }
+}
+
+
+// The request the VM running on this thread is serving.  Each Mozart VM
+// runs on a thread of its own, so this is effectively a VM-local slot.
+static thread_local request_context* current_context = 0;
+
+// The resident VM running on this thread, if it is one
+static thread_local resident_vm* current_resident = 0;
+
+static request_context& current_request(mozart::VM vm)
+{
+    request_context* ctx = current_context;
+    if (!ctx && current_resident) {
+        ctx = current_resident->request_of(vm->getCurrentThread());
+    }
+    if (!ctx) {
+        mozart::raiseError(vm, "apache", "noRequest");
+    }
+    return *ctx;
+}
+
+// The request, for a builtin about to write to it
+static request_context& current_writer(mozart::VM vm)
+{
+    request_context& ctx = current_request(vm);
+    if (current_resident) {
+        ctx.throttle(vm);
+    }
+    return ctx;
+}
+
+static resident_vm& current_resident_vm(mozart::VM vm)
+{
+    if (!current_resident) {
+        mozart::raiseError(vm, "apache", "notResident");
+    }
+    return *current_resident;
+}
+
+static mozart::UnstableNode build_string(mozart::VM vm, char const* p, size_t n)
+{
+    return mozart::String::build(vm, mozart::newLString(vm, p, static_cast<mozart::nativeint>(n)));
+}
+
+static mozart::UnstableNode build_string(mozart::VM vm, char const* p)
+{
+    return build_string(vm, p, strlen(p));
+}
+
+// Calls f on every element of the Oz list n, suspending on unbound tails.
+template <typename F>
+static void ozForEachListItem(mozart::VM vm, mozart::RichNode n, F f)
+{
+    using namespace mozart::patternmatching;
+    for (;;) {
+        mozart::RichNode head, tail;
+        if (n.isTransient()) {
+            mozart::waitFor(vm, n);
+        }
+        if (matchesCons(vm, n, capture(head), capture(tail))) {
+            f(head);
+            n = tail;
+        } else if (matches(vm, n, vm->coreatoms.nil)) {
+            return;
+        } else {
+            mozart::raiseTypeError(vm, "List", n);
+        }
+    }
+}
+
+static void ozGetPair(mozart::VM vm, mozart::RichNode n, mozart::RichNode& first, mozart::RichNode& second)
+{
+    using namespace mozart::patternmatching;
+    if (n.isTransient()) {
+        mozart::waitFor(vm, n);
+    }
+    if (!matchesSharp(vm, n, wildcard(), wildcard())) {
+        mozart::raiseTypeError(vm, "Pair", n);
+    }
+    auto tuple = n.as<mozart::Tuple>();
+    first = *tuple.getElement(0);
+    second = *tuple.getElement(1);
+}
+
+static std::string url_decode(char const* p, size_t n)
+{
+    std::string result;
+    result.reserve(n);
+    for (char const* end = p + n; p < end; ++p) {
+        if (*p == '+') {
+            result += ' ';
+        } else if (*p == '%' && end - p > 2 && apr_isxdigit(p[1]) && apr_isxdigit(p[2])) {
+            char hex[3] = { p[1], p[2], 0 };
+            result += static_cast<char>(strtol(hex, NULL, 16));
+            p += 2;
+        } else {
+            result += *p;
+        }
+    }
+    return result;
+}
+
+// Builds a list of Key#Value pairs out of "k1=v1<sep>k2=v2...".
+static mozart::UnstableNode build_pairs(mozart::VM vm, char const* p, char sep, bool decode)
+{
+    std::vector<std::pair<std::string, std::string>> pairs;
+    while (p && *p) {
+        while (*p == ' ') {
+            ++p;
+        }
+        char const* end = strchr(p, sep);
+        if (!end) {
+            end = p + strlen(p);
+        }
+        if (end > p) {
+            char const* eq = static_cast<char const*>(memchr(p, '=', end - p));
+            char const* vp = eq ? eq + 1 : end;
+            std::string key(decode ? url_decode(p, (eq ? eq : end) - p) : std::string(p, (eq ? eq : end) - p));
+            std::string value(decode ? url_decode(vp, end - vp) : std::string(vp, end - vp));
+            pairs.push_back(std::make_pair(key, value));
+        }
+        p = *end ? end + 1 : end;
+    }
+    mozart::UnstableNode list = mozart::build(vm, vm->coreatoms.nil);
+    for (auto i = pairs.rbegin(); i != pairs.rend(); ++i) {
+        list = mozart::buildCons(vm,
+            mozart::buildSharp(vm, build_string(vm, i->first.data(), i->first.size()),
+                                   build_string(vm, i->second.data(), i->second.size())),
+            std::move(list));
+    }
+    return list;
+}
+
+static int collect_header(void* data, char const* key, char const* value)
+{
+    static_cast<std::vector<std::pair<char const*, char const*>>*>(data)->push_back(std::make_pair(key, value));
+    return 1;
+}
+
+// Converts a single feature of Apache.request.  Only reads the request_rec
+// and never allocates from its pool, since the worker owns the pool while
+// the VM runs.
+static bool build_request_field(mozart::VM vm, request_fields const& r, std::string const& feature, mozart::UnstableNode& result)
+{
+    if (feature == "method") {
+        result = build_string(vm, r.method);
+    } else if (feature == "uri") {
+        result = build_string(vm, r.uri);
+    } else if (feature == "unparsedUri") {
+        result = build_string(vm, r.unparsed_uri);
+    } else if (feature == "args") {
+        result = build_string(vm, r.args ? r.args : "");
+    } else if (feature == "query") {
+        result = build_pairs(vm, r.args, '&', true);
+    } else if (feature == "cookies") {
+        result = build_pairs(vm, apr_table_get(r.headers_in, "Cookie"), ';', false);
+    } else if (feature == "headers") {
+        std::vector<std::pair<char const*, char const*>> headers;
+        apr_table_do(collect_header, &headers, r.headers_in, NULL);
+        result = mozart::build(vm, vm->coreatoms.nil);
+        for (auto i = headers.rbegin(); i != headers.rend(); ++i) {
+            result = mozart::buildCons(vm, mozart::buildSharp(vm, build_string(vm, i->first), build_string(vm, i->second)), std::move(result));
+        }
+    } else if (feature == "remoteAddr") {
+        result = build_string(vm, r.useragent_ip);
+    } else if (feature == "protocol") {
+        result = build_string(vm, r.protocol);
+    } else if (feature == "hostname") {
+        result = build_string(vm, r.hostname ? r.hostname : "");
+    } else if (feature == "filename") {
+        result = build_string(vm, r.filename);
+    } else if (feature == "pathInfo") {
+        result = build_string(vm, r.path_info ? r.path_info : "");
+    } else {
+        return false;
+    }
+    return true;
+}
+
+class ApacheModule: public mozart::BuiltinModule {
+
+public:
+    class SetContentType: public mozart::builtins::Builtin<SetContentType> {
+    public:
+        SetContentType(): Builtin("setContentType") {}
+
+        static void call(mozart::VM vm, mozart::builtins::In str) {
+            profile_scope scope(profiler::SET_CONTENT_TYPE);
+            request_context& ctx = current_request(vm);
+            std::string strVal;
+            ozVSGet(vm, str, strVal);
+            ctx.out.set_content_type(strVal);
+        }
+    };
+
+    class Rputs: public mozart::builtins::Builtin<Rputs> {
+    public:
+        Rputs(): Builtin("rputs") {}
+
+        static void call(mozart::VM vm, mozart::builtins::In str) {
+            profile_scope scope(profiler::RPUTS);
+            ozVSWrite(vm, str, current_writer(vm).out);
+        }
+
+    };
+
+    // {Apache.rputsHtmlEscaped VS}, {Apache.rputsUrlEncoded VS}: like
+    // rputs, escaping on the way without building the escaped string
+    class RputsHtmlEscaped: public mozart::builtins::Builtin<RputsHtmlEscaped> {
+    public:
+        RputsHtmlEscaped(): Builtin("rputsHtmlEscaped") {}
+
+        static void call(mozart::VM vm, mozart::builtins::In str) {
+            profile_scope scope(profiler::RPUTS_HTML_ESCAPED);
+            output_channel& out = current_writer(vm).out;
+            ozWriteAtomically(out, [&] () {
+                escaping_sink<html_escaper> sink(out);
+                ozVSWalk(vm, str, sink);
+            });
+        }
+    };
+
+    class RputsUrlEncoded: public mozart::builtins::Builtin<RputsUrlEncoded> {
+    public:
+        RputsUrlEncoded(): Builtin("rputsUrlEncoded") {}
+
+        static void call(mozart::VM vm, mozart::builtins::In str) {
+            profile_scope scope(profiler::RPUTS_URL_ENCODED);
+            output_channel& out = current_writer(vm).out;
+            ozWriteAtomically(out, [&] () {
+                escaping_sink<url_encoder> sink(out);
+                ozVSWalk(vm, str, sink);
+            });
+        }
+    };
+
+    class RputsBase64: public mozart::builtins::Builtin<RputsBase64> {
+    public:
+        RputsBase64(): Builtin("rputsBase64") {}
+
+        static void call(mozart::VM vm, mozart::builtins::In str) {
+            profile_scope scope(profiler::RPUTS_BASE64);
+            output_channel& out = current_writer(vm).out;
+            ozWriteAtomically(out, [&] () {
+                base64_sink sink(out);
+                ozVSWalk(vm, str, sink);
+                sink.finish();
+            });
+        }
+    };
+
+    class RputsJson: public mozart::builtins::Builtin<RputsJson> {
+    public:
+        RputsJson(): Builtin("rputsJson") {}
+
+        static void call(mozart::VM vm, mozart::builtins::In value) {
+            profile_scope scope(profiler::RPUTS_JSON);
+            output_channel& out = current_writer(vm).out;
+            ozWriteAtomically(out, [&] () {
+                ozJsonWalk(vm, value, out);
+            });
+        }
+    };
+
+    // {Apache.render Path Record}: writes the template at Path, relative
+    // to the script's directory, filled in from Record
+    class Render: public mozart::builtins::Builtin<Render> {
+    public:
+        Render(): Builtin("render") {}
+
+        static void call(mozart::VM vm, mozart::builtins::In path, mozart::builtins::In record) {
+            profile_scope scope(profiler::RENDER);
+            request_context& ctx = current_writer(vm);
+            std::string pathVal;
+            ozVSGet(vm, path, pathVal);
+            fs::path file(pathVal);
+            if (file.is_relative()) {
+                file = fs::path(ctx.request.filename).parent_path() / file;
+            }
+            wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(ctx.r->server->module_config, &wozozo_module));
+            std::shared_ptr<compiled_template const> tmpl(conf->templates.get(file));
+            if (!tmpl) {
+                mozart::raiseError(vm, "apache", "templateNotFound", path);
+            }
+            if (!tmpl->error.empty()) {
+                mozart::raiseError(vm, "apache", "badTemplate", path, build_string(vm, tmpl->error.c_str()));
+            }
+            std::vector<mozart::RichNode> scopes(1, record);
+            ozWriteAtomically(ctx.out, [&] () {
+                ozTemplateRender(vm, tmpl, 0, tmpl->code.size(), scopes, ctx.out);
+            });
+        }
+    };
+
+    // {Apache.sendFile Path Offset Length}: sends Length bytes of the file
+    // at Path from Offset, or the rest of it if Length is unit, without
+    // the bytes ever reaching the VM
+    class SendFile: public mozart::builtins::Builtin<SendFile> {
+    public:
+        SendFile(): Builtin("sendFile") {}
+
+        static void call(mozart::VM vm, mozart::builtins::In path, mozart::builtins::In offset, mozart::builtins::In length) {
+            profile_scope scope(profiler::SEND_FILE);
+            request_context& ctx = current_writer(vm);
+            std::string pathVal;
+            ozVSGet(vm, path, pathVal);
+            fs::path file(pathVal);
+            if (file.is_relative()) {
+                file = fs::path(ctx.request.filename).parent_path() / file;
+            }
+            mozart::nativeint offsetVal = mozart::getArgument<mozart::nativeint>(vm, offset);
+            if (offsetVal < 0) {
+                mozart::raiseTypeError(vm, "Non-negative Int", offset);
+            }
+            if (length.isTransient()) {
+                mozart::waitFor(vm, length);
+            }
+            mozart::nativeint lengthVal = -1;
+            if (!length.is<mozart::Unit>()) {
+                lengthVal = mozart::getArgument<mozart::nativeint>(vm, length);
+                if (lengthVal < 0) {
+                    mozart::raiseTypeError(vm, "Non-negative Int or unit", length);
+                }
+            }
+            wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(ctx.r->server->module_config, &wozozo_module));
+            std::shared_ptr<open_file> opened(conf->files->get(file.string()));
+            if (!opened) {
+                mozart::raiseError(vm, "apache", "fileNotFound", path);
+            }
+            apr_off_t size = opened->finfo.size;
+            if (offsetVal > size || (lengthVal >= 0 && lengthVal > size - offsetVal)) {
+                mozart::raiseError(vm, "apache", "badRange", path, offset, length);
+            }
+            if (lengthVal < 0) {
+                lengthVal = static_cast<mozart::nativeint>(size - offsetVal);
+            }
+            if (lengthVal > 0) {
+                ctx.out.send_file(opened, offsetVal, static_cast<size_t>(lengthVal));
+            }
+        }
+    };
+
+    // {Apache.kvGet Key ?Value}: the value stored under Key as a
+    // ByteString, or unit
+    class KvGet: public mozart::builtins::Builtin<KvGet> {
+    public:
+        KvGet(): Builtin("kvGet") {}
+
+        static void call(mozart::VM vm, mozart::builtins::In key, mozart::builtins::Out result) {
+            profile_scope scope(profiler::KV_GET);
+            std::string keyVal;
+            ozVSGet(vm, key, keyVal);
+            std::shared_ptr<std::string const> value(store_of(vm).get(keyVal));
+            if (value) {
+                result = mozart::ByteString::build(vm, mozart::newLString(vm, reinterpret_cast<unsigned char const*>(value->data()), static_cast<mozart::nativeint>(value->size())));
+            } else {
+                result = mozart::build(vm, mozart::unit);
+            }
+        }
+    };
+
+    // {Apache.kvPut Key Value Seconds}: stores the virtual string Value
+    // under Key for that long, or until evicted if Seconds is 0
+    class KvPut: public mozart::builtins::Builtin<KvPut> {
+    public:
+        KvPut(): Builtin("kvPut") {}
+
+        static void call(mozart::VM vm, mozart::builtins::In key, mozart::builtins::In value, mozart::builtins::In seconds) {
+            profile_scope scope(profiler::KV_PUT);
+            kv_store& store = store_of(vm);
+            std::string keyVal;
+            ozVSGet(vm, key, keyVal);
+            std::shared_ptr<std::string> valueVal(std::make_shared<std::string>());
+            ozVSGet(vm, value, *valueVal);
+            mozart::nativeint secondsVal = mozart::getArgument<mozart::nativeint>(vm, seconds);
+            if (secondsVal < 0) {
+                mozart::raiseTypeError(vm, "Non-negative Int", seconds);
+            }
+            if (!store.put(keyVal, valueVal, apr_time_from_sec(secondsVal))) {
+                mozart::raiseError(vm, "apache", "valueTooLarge", key);
+            }
+        }
+    };
+
+    class KvDelete: public mozart::builtins::Builtin<KvDelete> {
+    public:
+        KvDelete(): Builtin("kvDelete") {}
+
+        static void call(mozart::VM vm, mozart::builtins::In key) {
+            profile_scope scope(profiler::KV_DELETE);
+            std::string keyVal;
+            ozVSGet(vm, key, keyVal);
+            store_of(vm).remove(keyVal);
+        }
+    };
+
+    class Rflush: public mozart::builtins::Builtin<Rflush> {
+    public:
+        Rflush(): Builtin("rflush") {}
+
+        static void call(mozart::VM vm) {
+            profile_scope scope(profiler::RFLUSH);
+            current_request(vm).out.flush();
+        }
+
+    };
+
+    // {Apache.request Feature ?Value}: converts the given part of the
+    // request to an Oz value the first time it is asked for.
+    class Request: public mozart::builtins::Builtin<Request> {
+    public:
+        Request(): Builtin("request") {}
+
+        static void call(mozart::VM vm, mozart::builtins::In feature, mozart::builtins::Out result) {
+            using namespace mozart::patternmatching;
+            request_context& ctx = current_request(vm);
+            mozart::atom_t atomValue;
+            if (!matches(vm, feature, capture(atomValue))) {
+                mozart::raiseTypeError(vm, "Atom", feature);
+            }
+            std::string key(atomValue.contents(), atomValue.length());
+            auto i = ctx.fields.find(key);
+            if (i == ctx.fields.end()) {
+                mozart::UnstableNode value;
+                if (!build_request_field(vm, ctx.request, key, value)) {
+                    mozart::raiseError(vm, "apache", "unknownRequestField", feature);
+                }
+                i = ctx.fields.insert(std::make_pair(key, vm->protect(std::move(value)))).first;
+            }
+            result.copy(vm, *i->second);
+        }
+    };
+
+    // {Apache.getHeader Name ?Value}: a single request header, or unit.
+    class GetHeader: public mozart::builtins::Builtin<GetHeader> {
+    public:
+        GetHeader(): Builtin("getHeader") {}
+
+        static void call(mozart::VM vm, mozart::builtins::In name, mozart::builtins::Out result) {
+            request_context& ctx = current_request(vm);
+            std::string nameVal;
+            ozVSGet(vm, name, nameVal);
+            char const* value = apr_table_get(ctx.request.headers_in, nameVal.c_str());
+            result = value ? build_string(vm, value) : mozart::build(vm, mozart::unit);
+        }
+    };
+
+    // {Apache.setHeaders [Name1#Value1 ...]}: sets all the given response
+    // headers in a single round trip to the worker.
+    class SetHeaders: public mozart::builtins::Builtin<SetHeaders> {
+    public:
+        SetHeaders(): Builtin("setHeaders") {}
+
+        static void call(mozart::VM vm, mozart::builtins::In headers) {
+            request_context& ctx = current_request(vm);
+            std::string buf;
+            ozForEachListItem(vm, headers, [vm, &buf] (mozart::RichNode item) {
+                mozart::RichNode name, value;
+                ozGetPair(vm, item, name, value);
+                std::string nameVal, valueVal;
+                ozVSGet(vm, name, nameVal);
+                ozVSGet(vm, value, valueVal);
+                buf.append(nameVal.c_str(), strlen(nameVal.c_str()) + 1);
+                buf.append(valueVal.c_str(), strlen(valueVal.c_str()) + 1);
+            });
+            ctx.out.set_headers(buf);
+        }
+    };
+
+    class SetStatus: public mozart::builtins::Builtin<SetStatus> {
+    public:
+        SetStatus(): Builtin("setStatus") {}
+
+        static void call(mozart::VM vm, mozart::builtins::In status) {
+            request_context& ctx = current_request(vm);
+            mozart::nativeint statusVal = mozart::getArgument<mozart::nativeint>(vm, status);
+            if (statusVal < 100 || statusVal > 599) {
+                mozart::raiseError(vm, "apache", "invalidStatus", status);
+            }
+            ctx.out.set_status(static_cast<int>(statusVal));
+        }
+    };
+
+    // {Apache.read ?Chunk}: the next chunk of the request body as a
+    // ByteString, or unit at the end.  Only the calling Oz thread waits
+    // while the worker reads from the client.
+    class Read: public mozart::builtins::Builtin<Read> {
+    public:
+        Read(): Builtin("read") {}
+
+        static void call(mozart::VM vm, mozart::builtins::Out result) {
+            profile_scope scope(profiler::READ);
+            request_context& ctx = current_request(vm);
+            if (ctx.pending_read && *ctx.pending_read) {
+                mozart::raiseError(vm, "apache", "readInProgress");
+            }
+            mozart::boostenv::BoostVM& boostVM = mozart::boostenv::BoostVM::forVM(vm);
+            mozart::UnstableNode readOnly;
+            ctx.pending_read = std::make_shared<mozart::ProtectedNode>(boostVM.createAsyncIOFeedbackNode(readOnly));
+            ctx.reader = &boostVM;
+            ctx.out.read(ctx.read_chunk_size);
+            result = std::move(readOnly);
+        }
+    };
+
+    // {Apache.subrequestsInOrderInOrder URIs ?Responses}: runs each URI as an
+    // internal subrequest, one after the other, and binds the matching
+    // element of Responses to response(status:S headers:H body:B) as soon
+    // as it is complete
+    class SubrequestsInOrder: public mozart::builtins::Builtin<SubrequestsInOrder> {
+    public:
+        SubrequestsInOrder(): Builtin("subrequestsInOrder") {}
+
+        static void call(mozart::VM vm, mozart::builtins::In uris, mozart::builtins::Out result) {
+            profile_scope scope(profiler::SUBREQUESTS);
+            request_context& ctx = current_request(vm);
+            mozart::boostenv::BoostVM* boostVM = &mozart::boostenv::BoostVM::forVM(vm);
+            std::shared_ptr<subrequest_batch> batch(std::make_shared<subrequest_batch>(boostVM));
+            ozForEachListItem(vm, uris, [vm, &batch] (mozart::RichNode uri) {
+                std::string uriVal;
+                ozVSGet(vm, uri, uriVal);
+                batch->uris.push_back(uriVal);
+            });
+            std::vector<mozart::UnstableNode> responses;
+            for (size_t i = 0; i < batch->uris.size(); ++i) {
+                mozart::UnstableNode readOnly;
+                batch->results.push_back(boostVM->createAsyncIOFeedbackNode(readOnly));
+                responses.push_back(std::move(readOnly));
+            }
+            mozart::UnstableNode list = mozart::build(vm, vm->coreatoms.nil);
+            for (auto i = responses.rbegin(); i != responses.rend(); ++i) {
+                list = mozart::buildCons(vm, std::move(*i), std::move(list));
+            }
+            if (!batch->uris.empty()) {
+                ctx.subrequests.push_back(batch);
+                ctx.out.run_subrequests(batch);
+            }
+            result = std::move(list);
+        }
+    };
+
+    // {Apache.cacheFor Seconds}: lets the response be served from the
+    // cache for that long.  Has to be called before any output.
+    class CacheFor: public mozart::builtins::Builtin<CacheFor> {
+    public:
+        CacheFor(): Builtin("cacheFor") {}
+
+        static void call(mozart::VM vm, mozart::builtins::In seconds) {
+            request_context& ctx = current_request(vm);
+            mozart::nativeint secondsVal = mozart::getArgument<mozart::nativeint>(vm, seconds);
+            if (secondsVal > 0) {
+                ctx.out.cache_for(static_cast<size_t>(secondsVal));
+            }
+        }
+    };
+
+    // {Apache.setETag VS}: quoted unless it already is
+    class SetETag: public mozart::builtins::Builtin<SetETag> {
+    public:
+        SetETag(): Builtin("setETag") {}
+
+        static void call(mozart::VM vm, mozart::builtins::In etag) {
+            request_context& ctx = current_request(vm);
+            std::string etagVal;
+            ozVSGet(vm, etag, etagVal);
+            if (etagVal.compare(0, 1, "\"") && etagVal.compare(0, 2, "W/")) {
+                etagVal = '"' + etagVal + '"';
+            }
+            ctx.out.set_etag(etagVal);
+        }
+    };
+
+    // {Apache.setLastModified Seconds}: seconds since the epoch
+    class SetLastModified: public mozart::builtins::Builtin<SetLastModified> {
+    public:
+        SetLastModified(): Builtin("setLastModified") {}
+
+        static void call(mozart::VM vm, mozart::builtins::In time) {
+            request_context& ctx = current_request(vm);
+            mozart::nativeint timeVal = mozart::getArgument<mozart::nativeint>(vm, time);
+            if (timeVal < 0) {
+                mozart::raiseError(vm, "apache", "invalidTime", time);
+            }
+            ctx.out.set_last_modified(static_cast<size_t>(timeVal));
+        }
+    };
+
+    // {Apache.serve Handler}: makes a resident VM call {Handler Req} in a
+    // new Oz thread for each request, and keeps the VM running for them.
+    class Serve: public mozart::builtins::Builtin<Serve> {
+    public:
+        Serve(): Builtin("serve") {}
+
+        static void call(mozart::VM vm, mozart::builtins::In handler) {
+            resident_vm& rvm = current_resident_vm(vm);
+            if (rvm.handler) {
+                mozart::raiseError(vm, "apache", "alreadyServing");
+            }
+            if (!mozart::Callable(handler).isProcedure(vm)) {
+                mozart::raiseTypeError(vm, "Procedure", handler);
+            }
+            mozart::boostenv::BoostVM& boostVM = mozart::boostenv::BoostVM::forVM(vm);
+            mozart::UnstableNode readOnly;
+            rvm.handler = vm->protect(handler);
+            rvm.keep_alive = boostVM.createAsyncIOFeedbackNode(readOnly);
+            rvm.boost = &boostVM;
+            rvm.app->up(&rvm);
+        }
+    };
+
+    // {Apache.adopt Req}: makes the calling Oz thread serve Req, so that
+    // the other procedures called from it act on Req.
+    class Adopt: public mozart::builtins::Builtin<Adopt> {
+    public:
+        Adopt(): Builtin("adopt") {}
+
+        static void call(mozart::VM vm, mozart::builtins::In req) {
+            resident_vm& rvm = current_resident_vm(vm);
+            mozart::nativeint id = mozart::getArgument<mozart::nativeint>(vm, req);
+            if (!rvm.adopt(vm, vm->getCurrentThread(), id)) {
+                mozart::raiseError(vm, "apache", "unknownRequest", req);
+            }
+        }
+    };
+
+    // {Apache.finish}: ends the response to the request the calling Oz
+    // thread serves.  Threads that adopted it may no longer touch it.
+    class Finish: public mozart::builtins::Builtin<Finish> {
+    public:
+        Finish(): Builtin("finish") {}
+
+        static void call(mozart::VM vm) {
+            if (!current_resident_vm(vm).finish(vm->getCurrentThread())) {
+                mozart::raiseError(vm, "apache", "noRequest");
+            }
+        }
+    };
+
+    // {Apache.upstream Name ?Conn}: checks a connection out of the pool
+    // OzUpstream defined as Name, waiting if it is at its limit.  Conn is
+    // unit if no connection could be made.
+    class Upstream: public mozart::builtins::Builtin<Upstream> {
+    public:
+        Upstream(): Builtin("upstream") {}
+
+        static void call(mozart::VM vm, mozart::builtins::In name, mozart::builtins::Out result) {
+            profile_scope scope(profiler::UPSTREAM);
+            request_context& ctx = current_request(vm);
+            std::string nameVal;
+            ozVSGet(vm, name, nameVal);
+            wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(ctx.r->server->module_config, &wozozo_module));
+            auto i = conf->upstreams.find(nameVal);
+            if (i == conf->upstreams.end()) {
+                mozart::raiseError(vm, "apache", "unknownUpstream", name);
+            }
+            mozart::boostenv::BoostVM* boostVM = &mozart::boostenv::BoostVM::forVM(vm);
+            if (!ctx.upstreams) {
+                ctx.upstreams = std::make_shared<upstream_leases>(boostVM);
+            }
+            mozart::UnstableNode readOnly;
+            std::shared_ptr<mozart::ProtectedNode> node(std::make_shared<mozart::ProtectedNode>(boostVM->createAsyncIOFeedbackNode(readOnly)));
+            std::shared_ptr<upstream_leases> leases(ctx.upstreams);
+            leases->pools.insert(i->second.get());
+            i->second->checkout([boostVM, node, leases] (std::shared_ptr<upstream_conn> const& conn) {
+                bool posted = leases->post([boostVM, node, leases, conn] () {
+                    mozart::UnstableNode value = mozart::build(boostVM->vm, mozart::unit);
+                    if (conn && leases->closed) {
+                        conn->pool->checkin(conn, false);
+                    } else if (conn) {
+                        value = mozart::build(boostVM->vm, leases->add(conn));
+                    }
+                    boostVM->bindAndReleaseAsyncIOFeedbackNode(*node, value);
+                });
+                if (!posted && conn) {
+                    conn->pool->checkin(conn, false);
+                }
+            }, leases.get());
+            result = std::move(readOnly);
+        }
+    };
+
+    // {Apache.upstreamSend Conn VS}: queues VS to be written to Conn
+    class UpstreamSend: public mozart::builtins::Builtin<UpstreamSend> {
+    public:
+        UpstreamSend(): Builtin("upstreamSend") {}
 
-static int wozozo_post_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp, server_rec *s);
-static void wozozo_child_init(apr_pool_t *pool, server_rec *s);
-static int wozozo_handler(request_rec *r);
+        static void call(mozart::VM vm, mozart::builtins::In conn, mozart::builtins::In data) {
+            profile_scope scope(profiler::UPSTREAM_SEND);
+            upstream_leases::lease& l = lease_of(vm, conn);
+            std::string dataVal;
+            ozVSGet(vm, data, dataVal);
+            l.conn->send(std::move(dataVal));
+        }
+    };
 
-static void wozozo_register_hooks(apr_pool_t *p)
-{
-    ap_hook_post_config(wozozo_post_config, NULL, NULL, APR_HOOK_MIDDLE);
-    ap_hook_child_init(wozozo_child_init, NULL, NULL, APR_HOOK_MIDDLE);
-    ap_hook_handler(wozozo_handler, NULL, NULL, APR_HOOK_MIDDLE);
-}
+    // {Apache.upstreamReceive Conn Max ?Data}: at most Max bytes read from
+    // Conn as a ByteString, or unit once it is closed
+    class UpstreamReceive: public mozart::builtins::Builtin<UpstreamReceive> {
+    public:
+        UpstreamReceive(): Builtin("upstreamReceive") {}
 
-AP_DECLARE_MODULE(wozozo) =
-{
-    STANDARD20_MODULE_STUFF,
-    NULL,                        /* per-directory config creator */
-    NULL,                        /* dir config merger */
-    wozozo_create_server_config, /* server config creator */
-    NULL,                        /* server config merger */
-    wozozo_commands,             /* command table */
-    wozozo_register_hooks        /* set up other request processing hooks */
-};
+        static void call(mozart::VM vm, mozart::builtins::In conn, mozart::builtins::In max, mozart::builtins::Out result) {
+            profile_scope scope(profiler::UPSTREAM_RECEIVE);
+            upstream_leases::lease& l = lease_of(vm, conn);
+            mozart::nativeint maxVal = mozart::getArgument<mozart::nativeint>(vm, max);
+            if (maxVal <= 0) {
+                mozart::raiseError(vm, "apache", "invalidSize", max);
+            }
+            if (l.receiving) {
+                mozart::raiseError(vm, "apache", "receiveInProgress", conn);
+            }
+            l.receiving = true;
+            mozart::boostenv::BoostVM* boostVM = &mozart::boostenv::BoostVM::forVM(vm);
+            mozart::UnstableNode readOnly;
+            std::shared_ptr<mozart::ProtectedNode> node(std::make_shared<mozart::ProtectedNode>(boostVM->createAsyncIOFeedbackNode(readOnly)));
+            std::shared_ptr<upstream_leases> leases(current_request(vm).upstreams);
+            mozart::nativeint id = mozart::getArgument<mozart::nativeint>(vm, conn);
+            l.conn->receive(static_cast<size_t>(maxVal), [boostVM, node, leases, id] (std::shared_ptr<std::vector<char>> const& data) {
+                leases->post([boostVM, node, leases, id, data] () {
+                    upstream_leases::lease* l = leases->find(id);
+                    if (l) {
+                        l->receiving = false;
+                    }
+                    mozart::UnstableNode value = data ?
+                        mozart::ByteString::build(boostVM->vm, mozart::newLString(boostVM->vm, reinterpret_cast<unsigned char const*>(data->data()), static_cast<mozart::nativeint>(data->size()))) :
+                        mozart::build(boostVM->vm, mozart::unit);
+                    boostVM->bindAndReleaseAsyncIOFeedbackNode(*node, value);
+                });
+            });
+            result = std::move(readOnly);
+        }
+    };
 
-} // extern "C"
+    // {Apache.upstreamRelease Conn}: checks Conn back in for reuse.  It is
+    // closed instead if it failed or still has I/O in progress.
+    class UpstreamRelease: public mozart::builtins::Builtin<UpstreamRelease> {
+    public:
+        UpstreamRelease(): Builtin("upstreamRelease") {}
 
-static int wozozo_post_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp, server_rec *s)
-{
-    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(s->module_config, &wozozo_module));
+        static void call(mozart::VM vm, mozart::builtins::In conn) {
+            lease_of(vm, conn);
+            current_request(vm).upstreams->release(mozart::getArgument<mozart::nativeint>(vm, conn), true);
+        }
+    };
 
-    if (conf->vm_args.oz_home) {
-        conf->vm_args.oz_home = ap_resolve_env(pconf, conf->vm_args.oz_home);
-    }
+    // {Apache.upstreamClose Conn}: closes Conn instead of reusing it
+    class UpstreamClose: public mozart::builtins::Builtin<UpstreamClose> {
+    public:
+        UpstreamClose(): Builtin("upstreamClose") {}
 
-    if (conf->vm_args.init_functor_path) {
-        conf->vm_args.init_functor_path = ap_resolve_env(pconf, conf->vm_args.init_functor_path);
-    }
+        static void call(mozart::VM vm, mozart::builtins::In conn) {
+            lease_of(vm, conn);
+            current_request(vm).upstreams->release(mozart::getArgument<mozart::nativeint>(vm, conn), false);
+        }
+    };
 
-    if (conf->vm_args.base_functor_path) {
-        conf->vm_args.base_functor_path = ap_resolve_env(pconf, conf->vm_args.base_functor_path);
+protected:
+    static kv_store& store_of(mozart::VM vm) {
+        request_context& ctx = current_request(vm);
+        wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(ctx.r->server->module_config, &wozozo_module));
+        if (!conf->kv) {
+            mozart::raiseError(vm, "apache", "noKVStore");
+        }
+        return *conf->kv;
     }
 
-    if (conf->vm_args.oz_search_path) {
-        conf->vm_args.oz_search_path = ap_resolve_env(pconf, conf->vm_args.oz_search_path);
+    static upstream_leases::lease& lease_of(mozart::VM vm, mozart::RichNode conn) {
+        request_context& ctx = current_request(vm);
+        mozart::nativeint id = mozart::getArgument<mozart::nativeint>(vm, conn);
+        upstream_leases::lease* l = ctx.upstreams ? ctx.upstreams->find(id) : 0;
+        if (!l) {
+            mozart::raiseError(vm, "apache", "unknownUpstreamConnection", conn);
+        }
+        return *l;
     }
 
-    if (conf->vm_args.oz_search_load) {
-        conf->vm_args.oz_search_load = ap_resolve_env(pconf, conf->vm_args.oz_search_load);
-    }
+    SetContentType instanceSetContentType;
+    Rputs instanceRputs;
+    Rflush instanceRflush;
+    Request instanceRequest;
+    GetHeader instanceGetHeader;
+    SetHeaders instanceSetHeaders;
+    SetStatus instanceSetStatus;
+    Read instanceRead;
+    SubrequestsInOrder instanceSubrequestsInOrder;
+    CacheFor instanceCacheFor;
+    SetETag instanceSetETag;
+    SetLastModified instanceSetLastModified;
+    Serve instanceServe;
+    Adopt instanceAdopt;
+    Finish instanceFinish;
+    Upstream instanceUpstream;
+    UpstreamSend instanceUpstreamSend;
+    UpstreamReceive instanceUpstreamReceive;
+    UpstreamRelease instanceUpstreamRelease;
+    UpstreamClose instanceUpstreamClose;
+    RputsHtmlEscaped instanceRputsHtmlEscaped;
+    RputsUrlEncoded instanceRputsUrlEncoded;
+    RputsBase64 instanceRputsBase64;
+    RputsJson instanceRputsJson;
+    Render instanceRender;
+    SendFile instanceSendFile;
+    KvGet instanceKvGet;
+    KvPut instanceKvPut;
+    KvDelete instanceKvDelete;
 
-    return check_mozart_vm_args(s, conf->vm_args);
-}
+public:
+    inline ApacheModule(mozart::VM vm)
+        : BuiltinModule(vm, "Apache") {
+        instanceRputs.setModuleName("Apache");
+        mozart::UnstableField fields[29];
+        fields[0].feature = mozart::build(vm, "setContentType");
+        fields[0].value = mozart::build(vm, instanceSetContentType);
+        fields[1].feature = mozart::build(vm, "rputs");
+        fields[1].value = mozart::build(vm, instanceRputs);
+        fields[2].feature = mozart::build(vm, "rflush");
+        fields[2].value = mozart::build(vm, instanceRflush);
+        fields[3].feature = mozart::build(vm, "request");
+        fields[3].value = mozart::build(vm, instanceRequest);
+        fields[4].feature = mozart::build(vm, "getHeader");
+        fields[4].value = mozart::build(vm, instanceGetHeader);
+        fields[5].feature = mozart::build(vm, "setHeaders");
+        fields[5].value = mozart::build(vm, instanceSetHeaders);
+        fields[6].feature = mozart::build(vm, "setStatus");
+        fields[6].value = mozart::build(vm, instanceSetStatus);
+        fields[7].feature = mozart::build(vm, "read");
+        fields[7].value = mozart::build(vm, instanceRead);
+        fields[8].feature = mozart::build(vm, "cacheFor");
+        fields[8].value = mozart::build(vm, instanceCacheFor);
+        fields[9].feature = mozart::build(vm, "setETag");
+        fields[9].value = mozart::build(vm, instanceSetETag);
+        fields[10].feature = mozart::build(vm, "setLastModified");
+        fields[10].value = mozart::build(vm, instanceSetLastModified);
+        fields[11].feature = mozart::build(vm, "serve");
+        fields[11].value = mozart::build(vm, instanceServe);
+        fields[12].feature = mozart::build(vm, "adopt");
+        fields[12].value = mozart::build(vm, instanceAdopt);
+        fields[13].feature = mozart::build(vm, "finish");
+        fields[13].value = mozart::build(vm, instanceFinish);
+        fields[14].feature = mozart::build(vm, "upstream");
+        fields[14].value = mozart::build(vm, instanceUpstream);
+        fields[15].feature = mozart::build(vm, "upstreamSend");
+        fields[15].value = mozart::build(vm, instanceUpstreamSend);
+        fields[16].feature = mozart::build(vm, "upstreamReceive");
+        fields[16].value = mozart::build(vm, instanceUpstreamReceive);
+        fields[17].feature = mozart::build(vm, "upstreamRelease");
+        fields[17].value = mozart::build(vm, instanceUpstreamRelease);
+        fields[18].feature = mozart::build(vm, "upstreamClose");
+        fields[18].value = mozart::build(vm, instanceUpstreamClose);
+        fields[19].feature = mozart::build(vm, "rputsHtmlEscaped");
+        fields[19].value = mozart::build(vm, instanceRputsHtmlEscaped);
+        fields[20].feature = mozart::build(vm, "rputsUrlEncoded");
+        fields[20].value = mozart::build(vm, instanceRputsUrlEncoded);
+        fields[21].feature = mozart::build(vm, "rputsBase64");
+        fields[21].value = mozart::build(vm, instanceRputsBase64);
+        fields[22].feature = mozart::build(vm, "rputsJson");
+        fields[22].value = mozart::build(vm, instanceRputsJson);
+        fields[23].feature = mozart::build(vm, "render");
+        fields[23].value = mozart::build(vm, instanceRender);
+        fields[24].feature = mozart::build(vm, "kvGet");
+        fields[24].value = mozart::build(vm, instanceKvGet);
+        fields[25].feature = mozart::build(vm, "kvPut");
+        fields[25].value = mozart::build(vm, instanceKvPut);
+        fields[26].feature = mozart::build(vm, "kvDelete");
+        fields[26].value = mozart::build(vm, instanceKvDelete);
+        fields[27].feature = mozart::build(vm, "sendFile");
+        fields[27].value = mozart::build(vm, instanceSendFile);
+        fields[28].feature = mozart::build(vm, "subrequestsInOrder");
+        fields[28].value = mozart::build(vm, instanceSubrequestsInOrder);
+        auto label = build(vm, "export");
+        auto module = buildRecordDynamic(vm, label, sizeof(fields) / sizeof(*fields), fields);
+        initModule(vm, std::move(module));
+    }
+};
 
-static apr_status_t wozozo_child_cleanup(void *_conf)
+static void set_application_url(mozart::VM vm, char const* url)
 {
-    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(_conf); 
-    if (conf->work) {
-        conf->work.reset();
-    }
+    auto decodedURL = mozart::toUTF<char>(mozart::makeLString(url));
+    auto appURL = vm->getAtom(decodedURL.length, decodedURL.string);
+    mozart::UnstableNode property = mozart::build(vm, "application.url");
+    mozart::UnstableNode value = mozart::build(vm, appURL);
+    vm->getPropertyRegistry().put(vm, property, value, true);
 }
 
-static void wozozo_child_init(apr_pool_t *pool, server_rec *s)
+static mozart::UnstableNode unpickle_functor(mozart::VM vm, functor_image const& image)
 {
-    wozozo_server_conf_t* conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(s->module_config, &wozozo_module));
-    std::shared_ptr<mozart::boostenv::BoostEnvironment> env(init_mozart_vm_env(s, conf->vm_args));
-    conf->env = env;
-    conf->work = std::move(std::unique_ptr<boost::asio::io_service::work>(new boost::asio::io_service::work(env->io_service)));
-    conf->io_thread = std::move(std::unique_ptr<boost::thread>(new boost::thread([env, conf, s]() {
-        ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, "Mozart IO thread started");
-        env->runIO();
-        ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, "Mozart IO thread ended");
-    })));
-    apr_pool_cleanup_register(pool, conf, wozozo_child_cleanup, wozozo_child_cleanup);
+    membuf buf(image.data(), static_cast<size_t>(image.size));
+    std::istream input(&buf);
+    return mozart::unpickle(vm, input);
 }
 
-struct condvar {
-    boost::condition_variable cond;
-    boost::mutex mtx;
+// Loads the Base environment (if configured) and the Init functor into vm,
+// leaving the functor bound in initFunctor.  When a boot image is
+// available the functor is unpickled from it instead.
+static bool boot_mozart_vm(mozart::VM vm, server_rec *s, mozart_vm_args_t const& args,
+                           fs::path const& baseFunctorPath, fs::path const& initFunctorPath,
+                           boot_image const* image, mozart::ProtectedNode& initFunctor,
+                           request_metrics* metrics)
+{
+    mozart::boostenv::BoostVM& boostVM = mozart::boostenv::BoostVM::forVM(vm);
+    mozart::boostenv::BoostEnvironment& boostEnv = mozart::boostenv::BoostEnvironment::forVM(vm);
+    apr_time_t start = apr_time_now();
 
-    inline void wait() {
-        boost::unique_lock<boost::mutex> lock(mtx);
-        cond.wait(lock);
+    if (image && image->data) {
+        membuf buf(image->data, image->size);
+        std::istream input(&buf);
+        initFunctor = vm->protect(mozart::unpickle(vm, input));
+        if (metrics) {
+            metrics->boot_init = apr_time_now() - start;
+        }
+        return true;
     }
 
-    inline void notify() {
-        cond.notify_one(); 
-    }
-};
+    // Some protected nodes
+    mozart::ProtectedNode baseEnv;
 
-struct _string: public std::string {
-    request_rec *r;
-    condvar* c;
-    inline _string(request_rec* r, condvar* c, char const* s): std::string(s), r(r), c(c) {}
-};
+    // Load the Base environment if required
+    if (args.base_functor_path) {
+        baseEnv = vm->protect(mozart::OptVar::build(vm));
 
-static int wozozo_handler(request_rec *r)
-{
-    int i;
-    wozozo_server_conf_t* server_conf = static_cast<wozozo_server_conf_t*>(ap_get_module_config(r->server->module_config, &wozozo_module));
-    if (strcmp(r->handler, "wozozo-handler")) {
-        return DECLINED;
-    }
+        mozart::UnstableNode baseValue;
 
-    if (!r->filename) {
-        return DECLINED;
+        if (!boostEnv.bootLoader(vm, baseFunctorPath.string(), baseValue)) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, APR_EINVAL, s,
+                         "could not load Base functor at %s",
+                         baseFunctorPath.string().c_str());
+            return false;
+        }
+
+        // Create the thread that loads the Base environment
+        if (mozart::Callable(baseValue).isProcedure(vm)) {
+            mozart::ozcalls::asyncOzCall(vm, baseValue, *baseEnv);
+        } else {
+            // Assume it is a functor that does not import anything
+            mozart::UnstableNode applyAtom = build(vm, "apply");
+            mozart::UnstableNode applyProc = mozart::Dottable(baseValue).dot(vm, applyAtom);
+            mozart::UnstableNode importParam = build(vm, "import");
+            mozart::ozcalls::asyncOzCall(vm, applyProc, importParam, *baseEnv);
+        }
+
+        boostVM.run();
     }
 
-    mozart::VirtualMachineOptions vmOptions;
-    vmOptions.minimalHeapSize = server_conf->vm_args.min_memory;
-    vmOptions.maximalHeapSize = server_conf->vm_args.max_memory;
+    apr_time_t base_loaded = apr_time_now();
+    if (metrics) {
+        metrics->boot_base = base_loaded - start;
+    }
 
-    if (r->header_only) return OK;
+    // Load the Init functor
+    {
+        initFunctor = vm->protect(mozart::OptVar::build(vm));
 
-    std::unique_ptr<condvar> c(new condvar);
+        mozart::UnstableNode initValue;
 
-    server_conf->env->addVM(1, std::move(std::unique_ptr<std::string>(new _string(r, c.get(), r->filename))), true, vmOptions);
-    c->wait();
-    return OK;
-}
+        if (!boostEnv.bootLoader(vm, initFunctorPath.string(), initValue)) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, APR_EINVAL, s,
+                         "could not load Init functor at %s",
+                         initFunctorPath.string().c_str());
+            return false;
+        }
 
+        // Create the thread that loads the Init functor
+        if (mozart::Callable(initValue).isProcedure(vm)) {
+            if (!args.base_functor_path) {
+                ap_log_error(APLOG_MARK, APLOG_ERR, APR_EINVAL, s,
+                             "Init.ozf is a procedure, but I have no Base to give to it");
+                return false;
+            }
 
-static int check_mozart_vm_args(server_rec *s, mozart_vm_args_t const& args)
-{
-    if (!args.oz_home) {
-        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "OzHome must be specified");
-        return DECLINED;
+            mozart::ozcalls::asyncOzCall(vm, initValue, *baseEnv, *initFunctor);
+            boostVM.run();
+        } else {
+            // Assume it is already the Init functor
+            mozart::DataflowVariable(*initFunctor).bind(vm, initValue);
+        }
     }
 
-    if (!(args.min_memory >= 1 * mozart::MegaBytes && args.min_memory < args.max_memory)) {
-        ap_log_error(APLOG_MARK, APLOG_ERR, APR_EINVAL, s,
-                     "Invalid heap sizes given: min_memory=%zd max_memory=%zd",
-                     args.min_memory, args.max_memory);
-        return DECLINED;
+    if (metrics) {
+        metrics->boot_init = apr_time_now() - base_loaded;
     }
-
-    return OK;
+    return true;
 }
 
-namespace std {
+// Applies the Init functor, which in turn links the application, and runs
+// the VM until every Oz thread is done.
+static void apply_init_functor(mozart::VM vm, mozart::RichNode initFunctor)
+{
+    mozart::boostenv::BoostVM& boostVM = mozart::boostenv::BoostVM::forVM(vm);
+
+    auto ApplyAtom = mozart::build(vm, "apply");
+    auto ApplyProc = mozart::Dottable(initFunctor).dot(vm, ApplyAtom);
 
-template<typename T>
-struct iterator_traits<reference_wrapper<T>> {
-    typedef ptrdiff_t difference_type;
-    typedef T value_type;
-    typedef const T* pointer;
-    typedef const T& reference;
-    typedef random_access_iterator_tag iterator_category;
-};
+    auto BootModule = vm->findBuiltinModule("Boot");
+    auto ImportRecord = mozart::buildRecord(
+        vm, buildArity(vm, "import", "Boot"),
+        BootModule);
 
+    mozart::ozcalls::asyncOzCall(vm, ApplyProc, ImportRecord, mozart::OptVar::build(vm));
+
+    boostVM.run();
 }
 
-static bool ozVSGet(mozart::VM vm, mozart::RichNode vs, char*& p)
+static fs::path init_functor_path_of(mozart_vm_args_t const& args)
 {
-    using namespace mozart::patternmatching;
-
-    size_t partCount;
-    mozart::StaticArray<mozart::StableNode> parts;
+    if (args.init_functor_path) {
+        return fs::path(args.init_functor_path);
+    }
+    return fs::path(args.oz_home) / PATH_LIT("share") / PATH_LIT("mozart") / PATH_LIT("Init.ozf");
+}
 
-    mozart::atom_t atomValue;
-    mozart::nativeint intValue;
-    double floatValue;
+static bool map_boot_image(apr_pool_t *pool, char const* path, boot_image& image)
+{
+    apr_file_t* file;
+    apr_finfo_t finfo;
+    apr_mmap_t* mm;
 
-    if (matchesVariadicSharp(vm, vs, partCount, parts)) {
-        for (size_t i = 0; i < partCount; ++i) {
-            if (!ozVSGet(vm, parts[i], std::ref(p)))
-                return false;
-        }
-        return true;
-    } else if (matches(vm, vs, capture(atomValue))) {
-        if (atomValue != vm->coreatoms.nil) {
-            std::copy_n(atomValue.contents(), atomValue.length(), std::ref(p));
-            p += atomValue.length();
-        }
-        return true;
-    } else if (matchesCons(vm, vs, wildcard(), wildcard())) {
-        mozart::internal::ozListForEachNoRaise(vm, vs,
-            [vm, &p] (char32_t c) {
-                char buffer[4];
-                mozart::nativeint length = mozart::toUTF(c, buffer);
-                std::copy_n(buffer, length, std::ref(p));
-            }
-        );
-        return true;
-    } else if (vs.is<mozart::String>()) {
-        auto& value = vs.as<mozart::String>().value();
-        std::copy(value.begin(), value.end(), std::ref(p));
-        return true;
-    } else if (matches(vm, vs, capture(intValue))) {
-        mozart::internal::IntToStrBuffer buffer;
-        auto length = mozart::internal::intToStrBuffer(buffer, intValue);
-        std::copy_n(buffer, length, std::ref(p));
-        return true;
-    } else if (vs.is<mozart::BigInt>()) {
-        std::string buffer = vs.as<mozart::BigInt>().str();
-        std::copy(buffer.begin(), buffer.end(), std::ref(p));
-        return true;
-    } else if (matches(vm, vs, capture(floatValue))) {
-        mozart::internal::FloatToStrBuffer buffer;
-        auto length = mozart::internal::floatToStrBuffer(buffer, floatValue);
-        std::copy_n(buffer, length, std::ref(p));
-        return true;
-    } else {
+    if (APR_SUCCESS != apr_file_open(&file, path, APR_FOPEN_READ | APR_FOPEN_BINARY, APR_OS_DEFAULT, pool)) {
         return false;
-    } 
-}
-
+    }
+    BOOST_SCOPE_EXIT((file)) {
+        apr_file_close(file);
+    } BOOST_SCOPE_EXIT_END;
 
-static char* ozVSGet(mozart::VM vm, mozart::RichNode n, apr_pool_t *pool, boost::optional<size_t&> len = boost::optional<size_t&>())
-{
-    mozart::nativeint l(mozart::ozVSLengthForBufferNoRaise(vm, n));
-    if (l < 0) {
-        return NULL;
+    if (APR_SUCCESS != apr_file_info_get(&finfo, APR_FINFO_SIZE, file) || finfo.size <= 0) {
+        return false;
     }
-    char* buf = static_cast<char*>(apr_pcalloc(pool, static_cast<size_t>(l) + 1));
-    {
-        char* p(buf);
-        if (!ozVSGet(vm, n, p)) {
-            mozart::raiseTypeError(vm, "VirtualString", n);
-            return NULL;
-        }
-        *p = 0;
-        if (len) {
-            *len = p - buf;
-        }
+    // The mapping outlives the descriptor and is released with the child pool
+    if (APR_SUCCESS != apr_mmap_create(&mm, file, 0, static_cast<apr_size_t>(finfo.size), APR_MMAP_READ, pool)) {
+        return false;
     }
-    return buf;
+    image.data = static_cast<char const*>(mm->mm);
+    image.size = static_cast<size_t>(finfo.size);
+    return true;
 }
 
+// Maps OzBootImage if it is newer than the functors it was made from, and
+// otherwise boots a VM to pickle its Init functor, writing the result out
+// for the other children.  Any failure leaves the image empty, so that VMs
+// fall back to loading Base and Init themselves.
+static void prepare_boot_image(apr_pool_t *pool, server_rec *s, wozozo_server_conf_t* conf)
+{
+    mozart_vm_args_t const& args = conf->vm_args;
+    fs::path imagePath(args.boot_image_path);
+    boost::system::error_code ec;
 
-class ApacheModule: public mozart::BuiltinModule {
-
-public:
-    class SetContentType: public mozart::builtins::Builtin<SetContentType> {
-    protected:
-        request_rec* r;
-    public:
-        SetContentType(request_rec* r): Builtin("setContentType"), r(r) {}
-
-        static void call(mozart::VM vm, mozart::builtins::In str) {
-            auto builtinNode = vm->findBuiltin("Apache", "setContentType");
-            auto builtin = reinterpret_cast<SetContentType*>(mozart::RichNode(builtinNode).as<mozart::BuiltinProcedure>().value());
-            char* strVal(ozVSGet(vm, str, builtin->r->pool));
-            ap_set_content_type(builtin->r, strVal);
+    std::time_t imageTime = fs::last_write_time(imagePath, ec);
+    if (!ec) {
+        std::time_t functorTime = fs::last_write_time(init_functor_path_of(args), ec);
+        if (!ec && args.base_functor_path) {
+            functorTime = std::max(functorTime, fs::last_write_time(fs::path(args.base_functor_path), ec));
         }
-    };
-
-    class Rputs: public mozart::builtins::Builtin<Rputs> {
-    protected:
-        request_rec* r;
-    public:
-        Rputs(request_rec* r): Builtin("rputs"), r(r) {}
-
-        static void call(mozart::VM vm, mozart::builtins::In str) {
-            auto builtinNode = vm->findBuiltin("Apache", "rputs");
-            auto builtin = reinterpret_cast<Rputs*>(mozart::RichNode(builtinNode).as<mozart::BuiltinProcedure>().value());
-            size_t strLen;
-            char* strVal(ozVSGet(vm, str, builtin->r->pool, strLen));
-            ap_rwrite(strVal, strLen, builtin->r);
+        if (!ec && imageTime >= functorTime && map_boot_image(pool, args.boot_image_path, *conf->image)) {
+            ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, "Mapped boot image %s", args.boot_image_path);
+            return;
         }
+    }
 
-    };
-
-    class Rflush: public mozart::builtins::Builtin<Rflush> {
-    protected:
-        request_rec* r;
-    public:
-        Rflush(request_rec* r): Builtin("rflush"), r(r) {}
+    mozart::VirtualMachineOptions vmOptions;
+    vmOptions.minimalHeapSize = args.min_memory;
+    vmOptions.maximalHeapSize = args.max_memory;
 
-        static void call(mozart::VM vm) {
-            auto builtinNode = vm->findBuiltin("Apache", "rflush");
-            auto builtin = reinterpret_cast<Rflush*>(mozart::RichNode(builtinNode).as<mozart::BuiltinProcedure>().value());
-            ap_rflush(builtin->r);
-        }
+    std::string pickled;
+    std::unique_ptr<condvar> c(new condvar);
+    conf->env->addVM(1, std::move(std::unique_ptr<std::string>(new _string(c.get(), &pickled))), true, vmOptions);
+    c->wait();
 
-    };
+    if (pickled.empty()) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "Could not create boot image; VMs will load Base and Init by themselves");
+        return;
+    }
 
-protected:
-    SetContentType instanceSetContentType;
-    Rputs instanceRputs;
-    Rflush instanceRflush;
+    // Write to a private file first so that concurrently starting children
+    // never map a partially written image
+    fs::path tmpPath(imagePath.string() + apr_psprintf(pool, ".%ld", static_cast<long>(getpid())));
+    {
+        fs::ofstream out(tmpPath, std::ios::binary);
+        out.write(pickled.data(), pickled.size());
+        out.close();
+        if (!out) {
+            fs::remove(tmpPath, ec);
+        } else {
+            fs::rename(tmpPath, imagePath, ec);
+        }
+    }
 
-public:
-    inline ApacheModule(mozart::VM vm, request_rec* r)
-        : BuiltinModule(vm, "Apache"),
-          instanceSetContentType(r),
-          instanceRputs(r),
-          instanceRflush(r) {
-        instanceRputs.setModuleName("Apache");
-        mozart::UnstableField fields[3];
-        fields[0].feature = mozart::build(vm, "setContentType");
-        fields[0].value = mozart::build(vm, instanceSetContentType);
-        fields[1].feature = mozart::build(vm, "rputs");
-        fields[1].value = mozart::build(vm, instanceRputs);
-        fields[2].feature = mozart::build(vm, "rflush");
-        fields[2].value = mozart::build(vm, instanceRflush);
-        auto label = build(vm, "export");
-        auto module = buildRecordDynamic(vm, label, sizeof(fields) / sizeof(*fields), fields);
-        initModule(vm, std::move(module));
+    if (!ec && map_boot_image(pool, args.boot_image_path, *conf->image)) {
+        ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, "Created boot image %s (%zd bytes)", args.boot_image_path, pickled.size());
+        return;
     }
-};
 
-static mozart::boostenv::BoostEnvironment* init_mozart_vm_env(server_rec *s, mozart_vm_args_t const& args)
+    ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "Could not write boot image %s; keeping it in memory", args.boot_image_path);
+    conf->image->buffer.swap(pickled);
+    conf->image->data = conf->image->buffer.data();
+    conf->image->size = conf->image->buffer.size();
+}
+
+static mozart::boostenv::BoostEnvironment* init_mozart_vm_env(server_rec *s, mozart_vm_args_t const& args, std::shared_ptr<boot_image> const& image, std::shared_ptr<child_stats> const& stats,
+                                                              std::shared_ptr<cpu_placement> const& placement)
 {
     if (OK != check_mozart_vm_args(s, args)) {
         return 0;
     }
 
-    fs::path ozHome(args.oz_home), initFunctorPath, baseFunctorPath;
-    if (args.init_functor_path) {
-        initFunctorPath = fs::path(args.init_functor_path);
-    }
+    fs::path ozHome(args.oz_home), initFunctorPath(init_functor_path_of(args)), baseFunctorPath;
     if (args.base_functor_path) {
         baseFunctorPath = fs::path(args.base_functor_path);
     }
 
-    if (initFunctorPath.empty()) {
-        initFunctorPath = ozHome / PATH_LIT("share") / PATH_LIT("mozart") / PATH_LIT("Init.ozf");
-    }
-
     // SET UP THE VM AND RUN
     return new mozart::boostenv::BoostEnvironment([=] (mozart::VM vm, std::unique_ptr<std::string> app, bool isURL) {
-        mozart::boostenv::BoostVM& boostVM = mozart::boostenv::BoostVM::forVM(vm);
         _string* _s(reinterpret_cast<_string*>(app.get()));
-        request_rec* r = _s->r;
+        vm_pool* pool = _s->pool;
+        request_context* ctx = _s->ctx;
         condvar* c = _s->c;
-        vm->registerBuiltinModule(std::make_shared<ApacheModule>(vm, r));
-        BOOST_SCOPE_EXIT((c)) {
-            c->notify();
+        std::string* imageOut = _s->image;
+        heap_profile* profile = _s->profile;
+        std::shared_ptr<resident_app> resident(_s->resident);
+        std::string script(profile || resident || (active_profiler && ctx) ? *_s : std::string());
+        // Before the VM touches its heap, so that the pages land on the
+        // node it is placed on
+        current_node = placement ? placement->place_vm() : 0;
+        if (current_node) {
+            ++current_node->vms;
+        }
+        vm->registerBuiltinModule(std::make_shared<ApacheModule>(vm));
+        current_context = ctx;
+        profiler::slot* slot = active_profiler ? active_profiler->enter() : 0;
+        current_slot = slot;
+        profile_phase(script.empty() ? 0 : script.c_str(), "(boot)");
+        mozart::boostenv::BoostVM* boostVM = &mozart::boostenv::BoostVM::forVM(vm);
+        if (ctx) {
+            // A VM of the request's own is simply terminated
+            ctx->attach([boostVM] () {
+                boostVM->requestTermination(1, "request canceled");
+            });
+        }
+        child_stats* vmStats = stats.get();
+        ++vmStats->active_vms;
+        BOOST_SCOPE_EXIT((ctx)(c)(vmStats)(slot)) {
+            --vmStats->active_vms;
+            current_context = 0;
+            current_resident = 0;
+            current_node = 0;
+            if (slot) {
+                current_slot = 0;
+                active_profiler->leave(slot);
+            }
+            if (ctx) {
+                ctx->close();
+            } else if (c) {
+                c->notify();
+            }
         } BOOST_SCOPE_EXIT_END;
 
         // Set some properties
@@ -542,7 +6190,18 @@ static mozart::boostenv::BoostEnvironment* init_mozart_vm_env(server_rec *s, moz
                 properties.registerValueProp(vm, "oz.search.load", vm->getAtom(std::string(args.oz_search_load)));
             }
 
-            if (isURL) {
+            if (pool) {
+                // Replaced for each job
+                properties.registerValueProp(vm, "application.url", vm->getAtom("<pooled VM>"));
+                if (args.functor_cache) {
+                    properties.registerValueProp(vm, "application.functor", mozart::OptVar::build(vm));
+                }
+            } else if (_s->functor) {
+                apr_time_t start = apr_time_now();
+                properties.registerValueProp(vm, "application.url", vm->getAtom("<VM.new functor>"));
+                properties.registerValueProp(vm, "application.functor", unpickle_functor(vm, *_s->functor));
+                ctx->metrics.app_load = apr_time_now() - start;
+            } else if (isURL) {
                 auto decodedURL = mozart::toUTF<char>(mozart::makeLString(app->c_str()));
                 auto appURL = vm->getAtom(decodedURL.length, decodedURL.string);
                 properties.registerValueProp(vm, "application.url", appURL);
@@ -560,86 +6219,121 @@ static mozart::boostenv::BoostEnvironment* init_mozart_vm_env(server_rec *s, moz
             properties.registerValueProp(vm, "application.gui", false);
         }
 
-        mozart::boostenv::BoostEnvironment& boostEnv = mozart::boostenv::BoostEnvironment::forVM(vm);
-
-        // Some protected nodes
-        mozart::ProtectedNode baseEnv, initFunctor;
-
-        // Register apache builtins
+        mozart::ProtectedNode initFunctor;
 
-        // Load the Base environment if required
-        if (args.base_functor_path) {
-            baseEnv = vm->protect(mozart::OptVar::build(vm));
-
-            mozart::UnstableNode baseValue;
-
-            if (!boostEnv.bootLoader(vm, baseFunctorPath.string(), baseValue)) {
-                ap_log_error(APLOG_MARK, APLOG_ERR, APR_EINVAL, s,
-                             "could not load Base functor at %s",
-                             baseFunctorPath.string().c_str());
-                return false;
+        request_metrics* metrics = ctx ? &ctx->metrics : 0;
+        if (metrics) {
+            metrics->booted = true;
+        }
+        if (!boot_mozart_vm(vm, s, args, baseFunctorPath, initFunctorPath, imageOut ? 0 : image.get(), initFunctor, metrics)) {
+            if (pool) {
+                pool->retire(false);
+            } else if (resident) {
+                resident_vm rvm(resident.get());
+                resident->down(&rvm);
             }
+            return false;
+        }
 
-            // Create the thread that loads the Base environment
-            if (mozart::Callable(baseValue).isProcedure(vm)) {
-                mozart::ozcalls::asyncOzCall(vm, baseValue, *baseEnv);
-            } else {
-                // Assume it is a functor that does not import anything
-                mozart::UnstableNode applyAtom = build(vm, "apply");
-                mozart::UnstableNode applyProc = mozart::Dottable(baseValue).dot(vm, applyAtom);
-                mozart::UnstableNode importParam = build(vm, "import");
-                mozart::ozcalls::asyncOzCall(vm, applyProc, importParam, *baseEnv);
+        if (imageOut) {
+            try {
+                std::ostringstream output;
+                mozart::pickle(vm, *initFunctor, output);
+                *imageOut = output.str();
+            } catch (...) {
+                ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "Init functor could not be pickled");
+                imageOut->clear();
             }
+            initFunctor.reset();
+            return true;
+        }
 
-            boostVM.run();
+        profile_phase(script.empty() ? 0 : script.c_str(), 0);
+        if (resident) {
+            // The application calls Apache.serve as it is linked, and the
+            // run then lasts until the VM is told to stop
+            resident_vm rvm(resident.get());
+            current_resident = &rvm;
+            apply_init_functor(vm, *initFunctor);
+            initFunctor.reset();
+            if (!rvm.handler) {
+                ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "%s did not call Apache.serve", script.c_str());
+            } else if (!rvm.requests.empty()) {
+                ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "%s left %lu requests without calling Apache.finish",
+                             script.c_str(), static_cast<unsigned long>(rvm.requests.size()));
+            }
+            resident->down(&rvm);
+            rvm.abandon();
+            current_resident = 0;
+            return true;
         }
 
-        // Load the Init functor
-        {
-            initFunctor = vm->protect(mozart::OptVar::build(vm));
+        if (!pool) {
+            if (current_node) {
+                ++current_node->requests;
+            }
+            apr_time_t start = apr_time_now();
+            apply_init_functor(vm, *initFunctor);
+            initFunctor.reset();
+            ctx->metrics.run = apr_time_now() - start;
+            // Nothing is collected after the run, so this is as close to
+            // the peak as the VM tells
+            ctx->metrics.heap = vm->getMemoryManager().getAllocated();
+            if (profile) {
+                profile->record(script, ctx->metrics.heap);
+            }
+            return true;
+        }
 
-            mozart::UnstableNode initValue;
+        // Functors this VM has already unpickled, along with the image they
+        // came from so that a replaced file is unpickled afresh
+        std::unordered_map<std::string, std::pair<std::shared_ptr<functor_image>, mozart::ProtectedNode>> functors;
 
-            if (!boostEnv.bootLoader(vm, initFunctorPath.string(), initValue)) {
-                ap_log_error(APLOG_MARK, APLOG_ERR, APR_EINVAL, s,
-                             "could not load Init functor at %s",
-                             initFunctorPath.string().c_str());
-                return false;
+        // Serve jobs until recycled or the pool is shut down
+        for (size_t served = 0; !pool->max_requests || served < pool->max_requests; ++served) {
+            _string* job = pool->take();
+            if (!job) {
+                break;
             }
-
-            // Create the thread that loads the Init functor
-            if (mozart::Callable(initValue).isProcedure(vm)) {
-                if (!args.base_functor_path) {
-                    ap_log_error(APLOG_MARK, APLOG_ERR, APR_EINVAL, s,
-                                 "Init.ozf is a procedure, but I have no Base to give to it");
-                    return false;
+            current_context = job->ctx;
+            profile_phase(job->c_str(), 0);
+            if (current_node) {
+                ++current_node->requests;
+            }
+            job->ctx->attach([boostVM] () {
+                boostVM->requestTermination(1, "request canceled");
+            });
+            request_metrics& jobMetrics = job->ctx->metrics;
+            if (job->functor) {
+                auto& entry = functors[*job];
+                if (entry.first != job->functor) {
+                    apr_time_t start = apr_time_now();
+                    entry.first = job->functor;
+                    entry.second = vm->protect(unpickle_functor(vm, *job->functor));
+                    jobMetrics.app_load = apr_time_now() - start;
                 }
-
-                mozart::ozcalls::asyncOzCall(vm, initValue, *baseEnv, *initFunctor);
-                boostVM.run();
+                mozart::UnstableNode property = mozart::build(vm, "application.functor");
+                vm->getPropertyRegistry().put(vm, property, *entry.second, true);
+                set_application_url(vm, "<VM.new functor>");
             } else {
-                // Assume it is already the Init functor
-                mozart::DataflowVariable(*initFunctor).bind(vm, initValue);
+                set_application_url(vm, job->c_str());
+            }
+            apr_time_t start = apr_time_now();
+            apply_init_functor(vm, *initFunctor);
+            jobMetrics.run = apr_time_now() - start;
+            jobMetrics.heap = vm->getMemoryManager().getAllocated();
+            current_context = 0;
+            profile_phase(0, 0);
+            // A terminated VM is replaced rather than given another job
+            bool terminated = job->ctx->detach();
+            job->finish();
+            if (terminated) {
+                break;
             }
         }
-
-        // Apply the Init functor
-        {
-            auto ApplyAtom = mozart::build(vm, "apply");
-            auto ApplyProc = mozart::Dottable(*initFunctor).dot(vm, ApplyAtom);
-
-            auto BootModule = vm->findBuiltinModule("Boot");
-            auto ImportRecord = mozart::buildRecord(
-                vm, buildArity(vm, "import", "Boot"),
-                BootModule);
-
-            mozart::ozcalls::asyncOzCall(vm, ApplyProc, ImportRecord, mozart::OptVar::build(vm));
-
-            baseEnv.reset();
-            initFunctor.reset();
-
-            boostVM.run();
-        }
+        functors.clear();
+        initFunctor.reset();
+        pool->retire(true);
 
         return true;
     });
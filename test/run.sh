@@ -0,0 +1,49 @@
+#!/bin/sh
+# Runs each test against an httpd of its own, started with
+# httpd.minimal.conf, and compares the response body with the test's
+# .expected file.
+
+set -e
+
+: ${HTTPD:=httpd}
+: ${HTTPD_ARGS:=}
+: ${CURL:=curl}
+
+pidfile=$PWD/test/httpd.pid
+export PWD
+failed=0
+
+stop_httpd() {
+    if [ -f "$pidfile" ]; then
+        pid=$(cat "$pidfile")
+        kill "$pid" 2>/dev/null || true
+        while kill -0 "$pid" 2>/dev/null; do
+            sleep 0.1
+        done
+        rm -f "$pidfile"
+    fi
+}
+
+# test name and optionally a directive
+run() {
+    $HTTPD $HTTPD_ARGS -f "$PWD/httpd.minimal.conf" \
+        -c "PidFile $pidfile" \
+        ${2:+-c "$2"} \
+        -k start
+    while [ ! -f "$pidfile" ]; do
+        sleep 0.1
+    done
+    if $CURL -sf "http://localhost:8080/test/$1" | cmp -s - "test/$1.expected"; then
+        echo "ok $1"
+    else
+        echo "FAIL $1"
+        failed=1
+    fi
+    stop_httpd
+}
+
+trap stop_httpd EXIT
+
+run resident-gc "OzResidentVMs 1"
+
+exit $failed